@@ -18,26 +18,47 @@
 
 
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <ctype.h>
 #include <math.h>
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <linux/futex.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 
 #include <pthread.h>
 #include <semaphore.h>
 
+#include <linux/io_uring.h>
+
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 #include <x264.h>
 
+#include <zlib.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 
 
 enum
@@ -64,7 +85,25 @@ action
   {
     DUMP_INFO,
     SCREENSHOT,
-    RECORD
+    RECORD,
+    RECOVER,
+    ENCODE,
+    WORKER,
+    SERVE
+  };
+
+
+enum
+output_format
+  {
+    FORMAT_MATROSKA,
+    FORMAT_MP4,
+    FORMAT_MPEGTS,
+    FORMAT_H264,
+    FORMAT_RAW,
+    FORMAT_PPM,
+    FORMAT_PNG,
+    FORMAT_QOI
   };
 
 
@@ -72,8 +111,8 @@ struct
 cue
 {
   long timestamp;
-  int cluster_position;
-  int relative_position;
+  off_t cluster_position;
+  off_t relative_position;
 };
 
 
@@ -102,6 +141,39 @@ malloc_and_check (size_t size)
 }
 
 
+void
+store_int32_bigend (unsigned char *b, unsigned long num)
+{
+  b [0] = (num >> 24) & 0xff;
+  b [1] = (num >> 16) & 0xff;
+  b [2] = (num >> 8) & 0xff;
+  b [3] = num & 0xff;
+}
+
+
+void
+store_int64_bigend (unsigned char *b, long num)
+{
+  int i;
+
+  for (i = 0; i < 8; i++)
+    b [i] = (num >> (56-i*8)) & 0xff;
+}
+
+
+long
+load_bigend (const unsigned char *b, int len)
+{
+  long ret = 0;
+  int i;
+
+  for (i = 0; i < len; i++)
+    ret = (ret << 8) | b [i];
+
+  return ret;
+}
+
+
 drmDevice **
 get_devices (int *num)
 {
@@ -303,70 +375,460 @@ dump_drm_info_and_exit (void)
 }
 
 
+struct
+thread_args
+{
+  int index;
+  int total;
+
+  unsigned char *out;
+  char *in;
+  int x, y, w, h, p;
+  enum pixel_format pf;
+  enum pixel_order po;
+
+  /* when taking a png or qoi screenshot, the strip is also compressed */
+  enum output_format format;
+  struct image_band *band;
+  struct screenshot *shot;
+
+  /* when publishing frames, the strip is compared with the previous frame
+     and the changed area of the strip is returned */
+  unsigned char *prev;
+  int dirty_x0, dirty_y0, dirty_x1, dirty_y1;
+
+  /* when sending frames to encode workers, the strip is also packed */
+  struct strip_delta *delta;
+};
+
+
+#ifdef __x86_64__
+
+__attribute__ ((target ("ssse3")))
+int
+convert_xr24_span_ssse3 (unsigned char *out, const unsigned char *in, int n)
+{
+  const __m128i shuffle = _mm_setr_epi8 (2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13,
+					 12, -1, -1, -1, -1);
+  __m128i pix;
+  int i;
+
+  /* four pixels at a time; every store writes 4 bytes past their 12, so
+     we stop while there are still 2 pixels to overwrite them */
+
+  for (i = 0; i+6 <= n; i += 4)
+    {
+      pix = _mm_loadu_si128 ((const __m128i *)(in+i*4));
+      _mm_storeu_si128 ((__m128i *)(out+i*3), _mm_shuffle_epi8 (pix, shuffle));
+    }
+
+  return i;
+}
+
+#endif
+
+
 void
-dump_linear_pixels (char *buf, int w, int h, int p, enum pixel_format pf)
+convert_xr24_span (unsigned char *out, const unsigned char *in, int n)
 {
-  int i, j;
-  char *row = buf, *pix;
+  int i = 0;
+
+#ifdef __x86_64__
+  if (__builtin_cpu_supports ("ssse3"))
+    i = convert_xr24_span_ssse3 (out, in, n);
+#endif
+
+  for (; i < n; i++)
+    {
+      out [i*3] = in [i*4+2];
+      out [i*3+1] = in [i*4+1];
+      out [i*3+2] = in [i*4];
+    }
+}
+
+
+long
+tiledx4kb_offset (int x, int y, int p)
+{
+  return (long)y/8*4096*(p/512)+x/128*4096+(y%8)*512+(x%128)*4;
+}
+
+
+void
+convert_tiledx4kb_row (unsigned char *out, const unsigned char *in, int x,
+		       int y, int w, int p)
+{
+  int i, n;
+
+  /* a row of a tile is 128 pixels in a row of memory */
+
+  for (i = x; i < x+w; i += n, out += n*3)
+    {
+      n = 128-i%128 < x+w-i ? 128-i%128 : x+w-i;
+      convert_xr24_span (out, in+tiledx4kb_offset (i, y, p), n);
+    }
+}
+
+
+#define PNG_LEVEL Z_BEST_SPEED
+
+
+struct
+image_band
+{
+  /* the compressed rows of a strip; for png, a whole IDAT chunk, which
+     in the first strip starts with the zlib header too */
+  unsigned char *data;
+  size_t len;
+
+  /* for png, checksum and length of the rows before deflating */
+  uLong adler, filtered_len;
+};
+
+
+void
+store_png_chunk (unsigned char *chunk, const char *type, size_t len)
+{
+  /* the data must already be in place after the length and type */
+
+  store_int32_bigend (chunk, len);
+  memcpy (chunk+4, type, 4);
+  store_int32_bigend (chunk+8+len, crc32 (crc32 (0, NULL, 0), chunk+4,
+					  len+4));
+}
+
+
+void
+deflate_png_band (struct thread_args *arg, int j0, int j1)
+{
+  struct image_band *band = arg->band;
+  int rowlen = arg->w*3, last = j1 == arg->y+arg->h, head = j0 == arg->y,
+    j, ret;
+  unsigned char filter = 0, *row = arg->out+(size_t)(j0-arg->y)*rowlen;
+  z_stream strm = {0};
+  uLong bound;
+
+  band->adler = adler32 (0, NULL, 0);
+  band->filtered_len = (uLong)(j1-j0)*(rowlen+1);
+  band->len = 0;
+
+  if (j0 >= j1)
+    return;
+
+  /* every strip is an independent raw deflate stream; all but the last end
+     with a sync flush, which closes the blocks on a byte boundary without
+     marking them final, so the streams can simply be put one after the
+     other */
+
+  if (deflateInit2 (&strm, PNG_LEVEL, Z_DEFLATED, -15, 8,
+		    Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      fprintf (stderr, "couldn't initialize deflate\n");
+      exit (1);
+    }
+
+  /* the bound doesn't count the empty block of the sync flush */
+
+  bound = deflateBound (&strm, band->filtered_len)+16;
+  band->data = malloc_and_check (bound+14);
+
+  strm.next_out = band->data+8+2*head;
+  strm.avail_out = bound;
+
+  /* rows are not filtered: the window of deflate reaches the row above
+     even on wide screens, and on screen contents the predictors cost more
+     time than they save bytes.  So the rows are deflated where they are,
+     each after its filter byte */
+
+  for (j = j0; j < j1; j++, row += rowlen)
+    {
+      strm.next_in = &filter;
+      strm.avail_in = 1;
+      ret = deflate (&strm, Z_NO_FLUSH);
+
+      strm.next_in = row;
+      strm.avail_in = rowlen;
+      ret = deflate (&strm, j < j1-1 ? Z_NO_FLUSH
+		     : last ? Z_FINISH : Z_SYNC_FLUSH);
+
+      if (ret == Z_STREAM_ERROR || strm.avail_in)
+	break;
+
+      band->adler = adler32 (band->adler, &filter, 1);
+      band->adler = adler32 (band->adler, row, rowlen);
+    }
+
+  if (j < j1 || ret != (last ? Z_STREAM_END : Z_OK))
+    {
+      fprintf (stderr, "couldn't deflate screenshot\n");
+      exit (1);
+    }
+
+  if (head)
+    {
+      band->data [8] = 0x78;
+      band->data [9] = 0x01;
+    }
+
+  band->len = 12+2*head+strm.total_out;
+  store_png_chunk (band->data, "IDAT", band->len-12);
+
+  deflateEnd (&strm);
+}
+
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+
+
+struct
+qoi_encoder
+{
+  /* pixels are kept as 0xffRRGGBB, so the empty slots of the index, which
+     are zero, never match */
+  unsigned int prev, index [64];
+  int run;
+
+  unsigned char *out;
+};
+
+
+void
+encode_qoi_span (struct qoi_encoder *q, const unsigned char *in, int n)
+{
+  unsigned int px;
+  int i, r, g, b, dr, dg, db, hash;
+  unsigned char *o = q->out;
 
-  for (i = 0; i < h; i++)
+  for (i = 0; i < n; i++, in += 4)
     {
-      pix = row;
+      px = 0xff000000 | in [2] << 16 | in [1] << 8 | in [0];
 
-      for (j = 0; j < w; j++)
+      if (px == q->prev)
 	{
-	  switch (pf)
+	  if (++q->run == 62)
 	    {
-	    case XR24:
-	      putchar (pix [2]);
-	      putchar (pix [1]);
-	      putchar (pix [0]);
-	      break;
+	      *o++ = QOI_OP_RUN | 61;
+	      q->run = 0;
 	    }
 
-	  pix += 4;
+	  continue;
+	}
+
+      if (q->run)
+	{
+	  *o++ = QOI_OP_RUN | (q->run-1);
+	  q->run = 0;
+	}
+
+      r = in [2];
+      g = in [1];
+      b = in [0];
+      hash = (r*3+g*5+b*7+255*11) % 64;
+
+      if (q->index [hash] == px)
+	*o++ = QOI_OP_INDEX | hash;
+      else
+	{
+	  q->index [hash] = px;
+
+	  dr = (signed char)(r-((q->prev >> 16) & 0xff));
+	  dg = (signed char)(g-((q->prev >> 8) & 0xff));
+	  db = (signed char)(b-(q->prev & 0xff));
+
+	  if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+	    *o++ = QOI_OP_DIFF | (dr+2) << 4 | (dg+2) << 2 | (db+2);
+	  else if (dg >= -32 && dg <= 31 && dr-dg >= -8 && dr-dg <= 7
+		   && db-dg >= -8 && db-dg <= 7)
+	    {
+	      *o++ = QOI_OP_LUMA | (dg+32);
+	      *o++ = (dr-dg+8) << 4 | (db-dg+8);
+	    }
+	  else
+	    {
+	      *o++ = QOI_OP_RGB;
+	      *o++ = r;
+	      *o++ = g;
+	      *o++ = b;
+	    }
 	}
 
-      row += p;
+      q->prev = px;
     }
+
+  q->out = o;
 }
 
 
 void
-convert_tiledx4kb_pixels_to_linear (unsigned char *out, char *in, int x, int y,
-				    int w, int h, int p, enum pixel_format pf)
+encode_qoi_band (struct thread_args *arg, int j0, int j1)
 {
-  int destind = 0, srcind, i, j;
+  struct qoi_encoder q = {0};
+  const unsigned char *in = (unsigned char *)arg->in, *last;
+  int i, j, n;
+
+  /* a qoi stream only depends on the previous pixel and on the index,
+     and the decoder never finds a pixel in a slot that the encoder didn't
+     fill itself, so a strip can start with an empty index and the last
+     pixel of the strip above.  The pixels are encoded straight from the
+     framebuffer */
 
-  for (j = y; j < y+h; j++)
+  arg->band->len = 0;
+
+  if (j0 >= j1)
+    return;
+
+  arg->band->data = q.out = malloc_and_check ((size_t)(j1-j0)*arg->w*4+1);
+
+  if (j0 == arg->y)
+    q.prev = 0xff000000;
+  else
     {
-      for (i = x; i < x+w; i++)
-	{
-	  srcind = j/8*4096*(p/512)+i/128*4096+(j%8)*512+(i%128)*4;
+      last = in+(arg->po == LINEAR ? (long)(j0-1)*arg->p+(arg->x+arg->w-1)*4
+		 : tiledx4kb_offset (arg->x+arg->w-1, j0-1, arg->p));
+      q.prev = 0xff000000 | last [2] << 16 | last [1] << 8 | last [0];
+    }
+
+  for (j = j0; j < j1; j++)
+    {
+      if (arg->po == LINEAR)
+	encode_qoi_span (&q, in+(long)j*arg->p+arg->x*4, arg->w);
+      else
+	for (i = arg->x; i < arg->x+arg->w; i += n)
+	  {
+	    n = 128-i%128 < arg->x+arg->w-i ? 128-i%128 : arg->x+arg->w-i;
+	    encode_qoi_span (&q, in+tiledx4kb_offset (i, j, arg->p), n);
+	  }
+    }
 
-	  out [destind] = in [srcind+2];
-	  out [destind+1] = in [srcind+1];
-	  out [destind+2] = in [srcind];
+  if (q.run)
+    *q.out++ = QOI_OP_RUN | (q.run-1);
 
-	  destind += 3;
-	}
+  arg->band->len = q.out-arg->band->data;
+}
+
+
+void *
+convert_strip (void *args)
+{
+  struct thread_args *arg = args;
+  int striph = (arg->h+arg->total-1)/arg->total, j0, j1, j;
+  unsigned char *out, *in = (unsigned char *)arg->in;
+
+  j0 = arg->y+arg->index*striph < arg->y+arg->h
+    ? arg->y+arg->index*striph : arg->y+arg->h;
+  j1 = j0+striph < arg->y+arg->h ? j0+striph : arg->y+arg->h;
+  out = arg->out+(size_t)(j0-arg->y)*arg->w*3;
+
+  if (arg->format == FORMAT_QOI)
+    {
+      encode_qoi_band (arg, j0, j1);
+      return NULL;
+    }
+
+  for (j = j0; j < j1; j++, out += arg->w*3)
+    {
+      if (arg->po == LINEAR)
+	convert_xr24_span (out, in+(size_t)j*arg->p+arg->x*4, arg->w);
+      else
+	convert_tiledx4kb_row (out, in, arg->x, j, arg->w, arg->p);
+    }
+
+  if (arg->format == FORMAT_PNG)
+    deflate_png_band (arg, j0, j1);
+
+  return NULL;
+}
+
+
+struct
+screenshot
+{
+  char *buf;  /* the mapped framebuffer */
+  int x, y, w, h, p, nthreads;
+  enum pixel_format pf;
+  enum pixel_order po;
+  enum output_format format;
+
+  unsigned char *pixels;  /* converted rows, for png */
+  struct image_band *bands;
+
+  /* the threads wait for the next screenshot, so that a daemon doesn't
+     start them for each */
+  struct thread_args *args;
+  sem_t *may_start, has_finished;
+};
+
+
+void *
+convert_strips (void *args)
+{
+  struct thread_args *arg = args;
+
+  for (;;)
+    {
+      sem_wait (&arg->shot->may_start [arg->index]);
+      convert_strip (arg);
+      sem_post (&arg->shot->has_finished);
     }
+
+  return NULL;
 }
 
 
 void
-dump_tiledx4kb_pixels_linearly (char *buf, int x, int y, int w, int h, int p,
-				enum pixel_format pf)
+start_conversion_threads (struct screenshot *s)
 {
+  pthread_t thread;
   int i;
-  unsigned char *out = malloc_and_check (w*h*3);
 
-  convert_tiledx4kb_pixels_to_linear (out, buf, x, y, w, h, p, pf);
+  s->args = malloc_and_check (sizeof (*s->args) * s->nthreads);
+  s->may_start = malloc_and_check (sizeof (*s->may_start) * s->nthreads);
+  sem_init (&s->has_finished, 0, 0);
+
+  for (i = 0; i < s->nthreads; i++)
+    {
+      s->args [i].index = i;
+      s->args [i].total = s->nthreads;
+      s->args [i].shot = s;
+      sem_init (&s->may_start [i], 0, 0);
+
+      if (pthread_create (&thread, NULL, convert_strips, &s->args [i]))
+	{
+	  fprintf (stderr, "couldn't create thread\n");
+	  exit (1);
+	}
+    }
+}
+
+
+void
+convert_screenshot (struct screenshot *s, unsigned char *out)
+{
+  int i;
 
-  for (i = 0; i < w*h*3; i++)
-    putchar (out [i]);
+  for (i = 0; i < s->nthreads; i++)
+    {
+      s->args [i].out = out;
+      s->args [i].in = s->buf;
+      s->args [i].x = s->x;
+      s->args [i].y = s->y;
+      s->args [i].w = s->w;
+      s->args [i].h = s->h;
+      s->args [i].p = s->p;
+      s->args [i].pf = s->pf;
+      s->args [i].po = s->po;
+      s->args [i].format = s->format;
+      s->args [i].band = &s->bands [i];
+
+      sem_post (&s->may_start [i]);
+    }
 
-  free (out);
+  for (i = 0; i < s->nthreads; i++)
+    sem_wait (&s->has_finished);
 }
 
 
@@ -441,18 +903,16 @@ open_framebuffer (drmModeFB2 **fb2, int *cardfd, int *native_refresh)
 
 
 void
-take_screenshot_and_exit (int x, int y, int w, int h)
+open_screenshot (struct screenshot *s, int x, int y, int w, int h,
+		 enum output_format format, int *cardfd)
 {
   drmModeFB2 *fb2;
   struct stat statbuf;
-  enum pixel_format pf;
-  enum pixel_order po;
   long mod;
-  char *buf;
-  int dmabuf_fd, cardfd, pixel_format;
+  int dmabuf_fd, pixel_format;
 
 
-  dmabuf_fd = open_framebuffer (&fb2, &cardfd, NULL);
+  dmabuf_fd = open_framebuffer (&fb2, cardfd, NULL);
 
 
   w = w < 0 ? fb2->width-x : w;
@@ -468,23 +928,23 @@ take_screenshot_and_exit (int x, int y, int w, int h)
   pixel_format = fb2->pixel_format;
 
   if (!strncmp ((char *)&pixel_format, "XR24", 4))
-    pf = XR24;
+    s->pf = XR24;
   else
     {
       fprintf (stderr, "warning: unsupported pixel format, defaulting to XR24...\n");
-      pf = XR24;
+      s->pf = XR24;
     }
 
   mod = fb2->modifier;
 
   if (!MODIFIER_VENDOR (mod) && !MODIFIER_VALUE (mod))
-    po = LINEAR;
+    s->po = LINEAR;
   else if (MODIFIER_VENDOR (mod) == 1 && MODIFIER_VALUE (mod) == 1)
-    po = TILEDX_4KB;
+    s->po = TILEDX_4KB;
   else
     {
       fprintf (stderr, "warning: unsupported pixel order, defaulting to linear...\n");
-      po = LINEAR;
+      s->po = LINEAR;
     }
 
 
@@ -494,697 +954,5906 @@ take_screenshot_and_exit (int x, int y, int w, int h)
       exit (1);
     }
 
-  buf = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, dmabuf_fd,
-	      fb2->offsets [0]);
+  s->buf = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, dmabuf_fd,
+		 fb2->offsets [0]);
 
-  if (buf == (void *) -1)
+  if (s->buf == (void *) -1)
     {
       fprintf (stderr, "couldn't mmap dmabuf of the framebuffer\n");
       exit (1);
     }
 
+  s->x = x;
+  s->y = y;
+  s->w = w;
+  s->h = h;
+  s->p = fb2->pitches [0];
+  s->format = format;
+  s->nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+  s->pixels = format == FORMAT_PNG ? malloc_and_check ((size_t)w*h*3) : NULL;
+  s->bands = malloc_and_check (sizeof (*s->bands) * s->nthreads);
+
+  start_conversion_threads (s);
+}
+
+
+unsigned char *
+join_bands (struct screenshot *s, const unsigned char *head, size_t headlen,
+	    const unsigned char *tail, size_t taillen, size_t *size)
+{
+  unsigned char *ret, *p;
+  int i;
+
+  for (i = 0, *size = headlen+taillen; i < s->nthreads; i++)
+    *size += s->bands [i].len;
 
-  printf ("P6\n%d\n%d\n255\n", w, h);
+  p = ret = malloc_and_check (*size);
+  memcpy (p, head, headlen);
+  p += headlen;
 
-  switch (po)
+  for (i = 0; i < s->nthreads; i++)
     {
-    case LINEAR:
-      dump_linear_pixels (buf, fb2->width, fb2->height, fb2->pitches [0], pf);
-      break;
-    case TILEDX_4KB:
-      dump_tiledx4kb_pixels_linearly (buf, x, y, w, h, fb2->pitches [0], pf);
-      break;
+      if (s->bands [i].len)
+	{
+	  memcpy (p, s->bands [i].data, s->bands [i].len);
+	  p += s->bands [i].len;
+	  free (s->bands [i].data);
+	}
     }
 
-  exit (0);
+  memcpy (p, tail, taillen);
+
+  return ret;
 }
 
 
-void
-write_char (int fd, int ch)
+unsigned char *
+encode_png_screenshot (struct screenshot *s, size_t *size)
 {
-  unsigned char c = ch & 0xff;
+  unsigned char head [33], tail [28];
+  uLong adler = adler32 (0, NULL, 0);
+  int i;
 
-  if (write (fd, &c, 1) != 1)
-    {
-      fprintf (stderr, "couldn't write to output file: ");
-      perror ("");
-    }
-}
+  memcpy (head, "\x89PNG\r\n\x1a\n", 8);
+  store_int32_bigend (head+16, s->w);
+  store_int32_bigend (head+20, s->h);
+  head [24] = 8;  /* bit depth */
+  head [25] = 2;  /* truecolor */
+  head [26] = head [27] = head [28] = 0;
+  store_png_chunk (head+8, "IHDR", 13);
 
+  /* every thread converts, filters and deflates its own strip into an
+     IDAT chunk; the checksum of the zlib stream is made from theirs */
 
-void
-write_int32_bigend (int fd, int num)
-{
-  write_char (fd, (num >> 24) & 0xff);
-  write_char (fd, (num >> 16) & 0xff);
-  write_char (fd, (num >> 8) & 0xff);
-  write_char (fd, num & 0xff);
+  convert_screenshot (s, s->pixels);
+
+  for (i = 0; i < s->nthreads; i++)
+    adler = adler32_combine (adler, s->bands [i].adler,
+			     s->bands [i].filtered_len);
+
+  store_int32_bigend (tail+8, adler);
+  store_png_chunk (tail, "IDAT", 4);
+  store_png_chunk (tail+16, "IEND", 0);
+
+  return join_bands (s, head, sizeof (head), tail, sizeof (tail), size);
 }
 
 
-void
-write_int64_bigend (int fd, long num)
+unsigned char *
+encode_qoi_screenshot (struct screenshot *s, size_t *size)
 {
-  write_int32_bigend (fd, (num & 0xffffffff00000000) >> 32);
-  write_int32_bigend (fd, num);
-}
+  unsigned char head [14] = "qoif", tail [8] = {0, 0, 0, 0, 0, 0, 0, 1};
 
+  store_int32_bigend (head+4, s->w);
+  store_int32_bigend (head+8, s->h);
+  head [12] = 3;  /* rgb */
+  head [13] = 0;  /* srgb */
 
-const unsigned char ebml_header [] =
-  {0x1a, 0x45, 0xdf, 0xa3, 0xa3,
-   0x42, 0x86, 0x81, 0x01,
-   0x42, 0xf7, 0x81, 0x01,
-   0x42, 0xf2, 0x81, 0x04,
-   0x42, 0xf3, 0x81, 0x08,
-   0x42, 0x82, 0x88, 'm', 'a', 't', 'r', 'o', 's', 'k', 'a',
-   0x42, 0x87, 0x81, 0x04,
-   0x42, 0x85, 0x81, 0x02};
-unsigned char segment_header [] =
-  {0x18, 0x53, 0x80, 0x67, 0x00, 0x00, 0x00, 0x00};
+  /* every thread encodes its strip right from the framebuffer, and the
+     strips follow each other */
 
-#define SEGMENT_BODY_START (sizeof (ebml_header)+sizeof (segment_header))
+  convert_screenshot (s, NULL);
 
+  return join_bands (s, head, sizeof (head), tail, sizeof (tail), size);
+}
 
-void
-write_minimal_matroska_header (int outfd, int width, int height,
-			       int default_duration, x264_nal_t headers [],
-			       int headers_num, off_t *seekhead_offs)
+
+unsigned char *
+encode_screenshot (struct screenshot *s, size_t *size)
 {
-  x264_nal_t *sps = NULL, *pps = NULL;
-  int i, j, header_sz, avcrec_sz;
-  unsigned char tracks_header []
-    = {0x16, 0x54, 0xae, 0x6b, 0x00, /* all video tracks */
-       0xae, 0x00, /* track entry */
-       0xd7, 0x81, 0x1, /* track number */
-       0x73, 0xc5, 0x81, 0x1, /* track uid */
-       0x83, 0x81, 0x1, /* track type */
-       0x23, 0xe3, 0x83, 0x84, 0x00, 0x00, 0x00, 0x00, /* default duration */
-       0xe0, 0x88, /* video settings */
-       0xb0, 0x82, 0x00, 0x00, 0xba, 0x82, 0x00, 0x00, /* pixel width and height */
-       0x86, 0x8f, 'V', '_', 'M', 'P', 'E', 'G', '4', '/' , 'I', 'S', 'O',
-       '/', 'A', 'V', 'C', /* codec id */};
-  unsigned char codec_private_header []
-    = {0x63, 0xa2, 0x00}; /* codec private */
-  unsigned char avcrec_header []
-    = {0x01, 0x42, 0xc0, 0x1f, 0xff};
-  unsigned char other_headers []
-    = {0x11, 0x4d, 0x9b, 0x74, 0xad, /* seek head */
-       0x4d, 0xbb, 0x8b, /* seek of tracks */
-       0x53, 0xab, 0x84, 0x16, 0x54, 0xae, 0x6b, /* seek id of tracks */
-       0x53, 0xac, 0x81, 0x00, /* seek position of tracks */
-       0x4d, 0xbb, 0x8b, /* seek of info */
-       0x53, 0xab, 0x84, 0x15, 0x49, 0xa9, 0x66, /* seek id of info */
-       0x53, 0xac, 0x81, 0x00, /* seek position of info */
+  unsigned char *ppm;
+  char header [64];
+  int headlen;
 
-       0x4d, 0xbb, 0x8e, /* seek of cues */
-       0x53, 0xab, 0x84, 0x1c, 0x53, 0xbb, 0x6b, /* seek id of cues */
-       0x53, 0xac, 0x84, 0x00, 0x00, 0x00, 0x00, /* seek position of cues */
+  if (s->format == FORMAT_PNG)
+    return encode_png_screenshot (s, size);
 
-       0x15, 0x49, 0xa9, 0x66, 0x9f, /* info header */
-       0x2a, 0xd7, 0xb1, 0x83, 0x00, 0x00, 0x01, /* timestamp scale */
-       0x4d, 0x80, 0x89, 's', 'c', 'r', 'e', 'e', 'n', 'r', 'e', 'c', /* muxing app */
-       0x57, 0x41, 0x89, 's', 'c', 'r', 'e', 'e', 'n', 'r', 'e', 'c', /* writing app */
-  };
-  unsigned char *header;
+  if (s->format == FORMAT_QOI)
+    return encode_qoi_screenshot (s, size);
 
+  /* the whole image is converted in parallel right after its header */
 
-  for (i = 0; i < headers_num; i++)
-    {
-      switch (headers [i].i_type)
+  headlen = sprintf (header, "P6\n%d\n%d\n255\n", s->w, s->h);
+  *size = headlen+(size_t)s->w*s->h*3;
+  ppm = malloc_and_check (*size);
+  memcpy (ppm, header, headlen);
+
+  convert_screenshot (s, ppm+headlen);
+
+  return ppm;
+}
+
+
+void
+write_screenshot (int fd, const unsigned char *buf, size_t size)
+{
+  size_t off;
+  ssize_t ret;
+
+  for (off = 0; off < size; off += ret)
+    {
+      ret = write (fd, buf+off, size-off);
+
+      if (ret < 0 && errno == EINTR)
+	ret = 0;
+      else if (ret < 0)
+	{
+	  fprintf (stderr, "couldn't write screenshot: ");
+	  perror ("");
+	  exit (1);
+	}
+    }
+}
+
+
+void
+take_screenshot_and_exit (int x, int y, int w, int h,
+			  enum output_format format)
+{
+  struct screenshot s;
+  unsigned char *data;
+  size_t size;
+  int cardfd;
+
+  open_screenshot (&s, x, y, w, h, format, &cardfd);
+
+  /* the encoded image goes out in one write */
+
+  data = encode_screenshot (&s, &size);
+  write_screenshot (STDOUT_FILENO, data, size);
+
+  exit (0);
+}
+
+
+#define OUTPUT_BUFFER_SIZE (4 << 20)
+
+#define OUTPUT_BUFFER_ALIGNMENT 4096
+
+#define DIRECT_IO_BLOCK 4096  /* O_DIRECT writes are multiples of this */
+
+
+#define URING_ENTRIES 64
+
+#define URING_BUFFERS 4  /* output buffers that can be in flight together */
+
+#define URING_SYNC_INTERVAL (64 << 20)  /* bytes between asynchronous fsyncs */
+
+#define WRITEBACK_WINDOW (16 << 20)  /* bytes between writeback kicks */
+
+struct
+uring_write  /* a write submitted to io_uring */
+{
+  off_t offset;
+  size_t len, done;
+  unsigned char *data;
+  int buffer;  /* index of the output buffer, or -1 for a patch */
+  struct uring_write *next;
+};
+
+
+struct
+uring
+{
+  int fd;
+  unsigned entries;
+
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size;
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned queued;  /* sqes not yet passed to the kernel */
+  int busy;  /* operations not yet completed */
+
+  unsigned char *buffers [URING_BUFFERS];
+  int buffer_in_flight [URING_BUFFERS];
+
+  struct uring_write *in_flight, *pending_patches;
+  long long unsynced;
+};
+
+
+struct
+output_buffer  /* buffered writer for the output file */
+{
+  int fd;
+
+  unsigned char *buf;
+  size_t size, used;
+  off_t buf_offset;  /* file offset of buf [0] */
+
+  struct uring *ring;  /* NULL when writing synchronously */
+
+  off_t prealloc_chunk, preallocated_to;  /* chunk is zero when disabled */
+  off_t writeback_started_to, writeback_done_to;
+  int writeback;
+
+  int direct;  /* fd has O_DIRECT, so writes are made of whole blocks */
+
+  long syscalls;
+  long long bytes;
+  double syscall_time, max_stall;
+};
+
+
+double
+get_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec+ts.tv_nsec/1000000000.0;
+}
+
+
+void
+count_syscall (struct output_buffer *ob, double start)
+{
+  double t = get_time ()-start;
+
+  ob->syscalls++;
+  ob->syscall_time += t;
+
+  if (t > ob->max_stall)
+    ob->max_stall = t;
+}
+
+
+unsigned char *
+alloc_output_buffer (void)
+{
+  void *ret;
+
+  if (posix_memalign (&ret, OUTPUT_BUFFER_ALIGNMENT, OUTPUT_BUFFER_SIZE))
+    {
+      fprintf (stderr, "could not allocate %d bytes.  Exiting...\n",
+	       OUTPUT_BUFFER_SIZE);
+      exit (1);
+    }
+
+  return ret;
+}
+
+
+int
+probe_uring_ops (int fd)
+{
+  static const int ops [] = {IORING_OP_WRITE, IORING_OP_FSYNC,
+			     IORING_OP_SYNC_FILE_RANGE};
+  struct io_uring_probe *probe;
+  int i, ok;
+
+  /* io_uring came in 5.1, but plain writes only in 5.6, together with
+     the probe, so an older kernel fails the probe itself */
+
+  probe = malloc_and_check (sizeof (*probe)
+			    +256*sizeof (struct io_uring_probe_op));
+  memset (probe, 0, sizeof (*probe)+256*sizeof (struct io_uring_probe_op));
+
+  ok = syscall (__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+		256) >= 0;
+
+  for (i = 0; ok && i < sizeof (ops) / sizeof (ops [0]); i++)
+    ok = ops [i] <= probe->last_op
+      && probe->ops [ops [i]].flags & IO_URING_OP_SUPPORTED;
+
+  free (probe);
+  return ok;
+}
+
+
+struct uring *
+setup_uring (void)
+{
+  struct io_uring_params par;
+  struct uring *ring;
+  void *sq, *cq;
+  size_t sqsz, cqsz;
+  int fd, i;
+
+  memset (&par, 0, sizeof (par));
+
+  fd = syscall (__NR_io_uring_setup, URING_ENTRIES, &par);
+
+  if (fd < 0)
+    return NULL;
+
+  if (!probe_uring_ops (fd))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  sqsz = par.sq_off.array+par.sq_entries*sizeof (unsigned);
+  cqsz = par.cq_off.cqes+par.cq_entries*sizeof (struct io_uring_cqe);
+
+  if (par.features & IORING_FEAT_SINGLE_MMAP && cqsz > sqsz)
+    sqsz = cqsz;
+
+  sq = mmap (NULL, sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	     fd, IORING_OFF_SQ_RING);
+
+  if (sq == MAP_FAILED)
+    {
+      close (fd);
+      return NULL;
+    }
+
+  if (par.features & IORING_FEAT_SINGLE_MMAP)
+    cq = sq;
+  else
+    {
+      cq = mmap (NULL, cqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		 fd, IORING_OFF_CQ_RING);
+
+      if (cq == MAP_FAILED)
+	{
+	  close (fd);
+	  return NULL;
+	}
+    }
+
+  ring = malloc_and_check (sizeof (*ring));
+
+  ring->sqes = mmap (NULL, par.sq_entries*sizeof (struct io_uring_sqe),
+		     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+		     IORING_OFF_SQES);
+
+  if (ring->sqes == MAP_FAILED)
+    {
+      close (fd);
+      free (ring);
+      return NULL;
+    }
+
+  ring->fd = fd;
+  ring->entries = par.sq_entries;
+  ring->sq_map = sq;
+  ring->sq_map_size = sqsz;
+  ring->cq_map = cq;
+  ring->cq_map_size = cqsz;
+  ring->sq_head = (unsigned *)((char *)sq+par.sq_off.head);
+  ring->sq_tail = (unsigned *)((char *)sq+par.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)sq+par.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)sq+par.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)cq+par.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)cq+par.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)cq+par.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)cq+par.cq_off.cqes);
+  ring->queued = 0;
+  ring->busy = 0;
+
+  for (i = 0; i < URING_BUFFERS; i++)
+    {
+      ring->buffers [i] = alloc_output_buffer ();
+      ring->buffer_in_flight [i] = 0;
+    }
+
+  ring->in_flight = NULL;
+  ring->pending_patches = NULL;
+  ring->unsynced = 0;
+
+  return ring;
+}
+
+
+void
+enter_uring (struct output_buffer *ob, unsigned wait_nr)
+{
+  struct uring *ring = ob->ring;
+  double start = get_time ();
+  int ret;
+
+  do
+    {
+      ret = syscall (__NR_io_uring_enter, ring->fd, ring->queued, wait_nr,
+		     wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0)
+    {
+      fprintf (stderr, "couldn't submit to io_uring: ");
+      perror ("");
+      exit (1);
+    }
+
+  ring->queued -= ret < ring->queued ? ret : ring->queued;
+
+  count_syscall (ob, start);
+}
+
+
+struct io_uring_sqe *
+get_uring_sqe (struct output_buffer *ob)
+{
+  struct uring *ring = ob->ring;
+  unsigned tail = *ring->sq_tail, ind;
+  struct io_uring_sqe *sqe;
+
+  while (tail-__atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE)
+	 == ring->entries)
+    enter_uring (ob, 0);
+
+  ind = tail & *ring->sq_mask;
+  sqe = &ring->sqes [ind];
+  memset (sqe, 0, sizeof (*sqe));
+  ring->sq_array [ind] = ind;
+
+  __atomic_store_n (ring->sq_tail, tail+1, __ATOMIC_RELEASE);
+  ring->queued++;
+  ring->busy++;
+
+  return sqe;
+}
+
+
+void
+queue_uring_write (struct output_buffer *ob, struct uring_write *wr)
+{
+  struct io_uring_sqe *sqe = get_uring_sqe (ob);
+
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = ob->fd;
+  sqe->addr = (unsigned long)(wr->data+wr->done);
+  sqe->len = wr->len-wr->done;
+  sqe->off = wr->offset+wr->done;
+  sqe->user_data = (unsigned long)wr;
+}
+
+
+void
+queue_uring_fsync (struct output_buffer *ob, int after_all_writes)
+{
+  struct io_uring_sqe *sqe = get_uring_sqe (ob);
+
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = ob->fd;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->flags = after_all_writes ? IOSQE_IO_DRAIN : 0;
+  sqe->user_data = 0;
+
+  ob->ring->unsynced = 0;
+}
+
+
+void
+queue_uring_sync_range (struct output_buffer *ob, off_t offset, off_t len,
+			unsigned flags)
+{
+  struct io_uring_sqe *sqe = get_uring_sqe (ob);
+
+  sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+  sqe->fd = ob->fd;
+  sqe->off = offset;
+  sqe->len = len;
+  sqe->sync_range_flags = flags;
+  sqe->user_data = 0;
+}
+
+
+int
+overlaps_in_flight_write (struct uring *ring, off_t offset, size_t len)
+{
+  struct uring_write *wr = ring->in_flight;
+
+  while (wr)
+    {
+      if (offset < wr->offset+wr->len && wr->offset < offset+len)
+	return 1;
+
+      wr = wr->next;
+    }
+
+  return 0;
+}
+
+
+void
+submit_uring_write (struct output_buffer *ob, struct uring_write *wr)
+{
+  struct uring *ring = ob->ring;
+  struct uring_write **p;
+
+  /* a patch must land after the data it overwrites, so it waits for any
+     write still in flight on the same range */
+
+  if (wr->buffer < 0 && overlaps_in_flight_write (ring, wr->offset, wr->len))
+    {
+      p = &ring->pending_patches;
+
+      while (*p)
+	p = &(*p)->next;
+
+      wr->next = NULL;
+      *p = wr;
+      return;
+    }
+
+  wr->next = ring->in_flight;
+  ring->in_flight = wr;
+  queue_uring_write (ob, wr);
+}
+
+
+void
+reap_uring (struct output_buffer *ob)
+{
+  struct uring *ring = ob->ring;
+  unsigned head = *ring->cq_head;
+  struct io_uring_cqe *cqe;
+  struct uring_write *wr, **p, *pending;
+
+  while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+      cqe = &ring->cqes [head & *ring->cq_mask];
+      wr = (struct uring_write *)(unsigned long)cqe->user_data;
+      head++;
+      ring->busy--;
+
+      if (cqe->res < 0)
+	{
+	  fprintf (stderr, "couldn't write to output file: %s\n",
+		   strerror (-cqe->res));
+	  exit (1);
+	}
+
+      if (!wr)  /* an fsync or a sync_file_range */
+	continue;
+
+      ob->bytes += cqe->res;
+      wr->done += cqe->res;
+
+      if (wr->done < wr->len)  /* short write, submit the rest */
+	{
+	  if (!cqe->res)
+	    {
+	      fprintf (stderr, "couldn't write to output file\n");
+	      exit (1);
+	    }
+
+	  queue_uring_write (ob, wr);
+	  continue;
+	}
+
+      p = &ring->in_flight;
+
+      while (*p != wr)
+	p = &(*p)->next;
+
+      *p = wr->next;
+
+      if (wr->buffer >= 0)
+	ring->buffer_in_flight [wr->buffer] = 0;
+      else
+	free (wr->data);
+
+      free (wr);
+    }
+
+  __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+
+  pending = ring->pending_patches;
+  ring->pending_patches = NULL;
+
+  while (pending)
+    {
+      wr = pending;
+      pending = pending->next;
+      submit_uring_write (ob, wr);
+    }
+}
+
+
+void
+uring_flush (struct output_buffer *ob)
+{
+  struct uring *ring = ob->ring;
+  struct uring_write *wr;
+  int i, cur = -1;
+
+  for (i = 0; i < URING_BUFFERS; i++)
+    {
+      if (ring->buffers [i] == ob->buf)
+	cur = i;
+    }
+
+  if (ob->used)
+    {
+      wr = malloc_and_check (sizeof (*wr));
+      wr->offset = ob->buf_offset;
+      wr->len = ob->used;
+      wr->done = 0;
+      wr->data = ob->buf;
+      wr->buffer = cur;
+      ring->buffer_in_flight [cur] = 1;
+      submit_uring_write (ob, wr);
+
+      ring->unsynced += ob->used;
+
+      if (ring->unsynced >= URING_SYNC_INTERVAL)
+	queue_uring_fsync (ob, 0);
+    }
+
+  enter_uring (ob, 0);
+  reap_uring (ob);
+
+  ob->buf_offset += ob->used;
+  ob->used = 0;
+
+  for (;;)
+    {
+      for (i = 0; i < URING_BUFFERS; i++)
+	{
+	  if (!ring->buffer_in_flight [i])
+	    {
+	      ob->buf = ring->buffers [i];
+	      return;
+	    }
+	}
+
+      enter_uring (ob, 1);
+      reap_uring (ob);
+    }
+}
+
+
+void
+uring_patch (struct output_buffer *ob, off_t pos, const void *data, size_t sz)
+{
+  struct uring_write *wr = malloc_and_check (sizeof (*wr));
+
+  wr->offset = pos;
+  wr->len = sz;
+  wr->done = 0;
+  wr->data = malloc_and_check (sz);
+  memcpy (wr->data, data, sz);
+  wr->buffer = -1;
+
+  submit_uring_write (ob, wr);
+}
+
+
+void
+init_output_buffer (struct output_buffer *ob, int fd, int use_uring,
+		    int prealloc_mb)
+{
+  struct stat statbuf;
+
+  ob->fd = fd;
+  ob->ring = NULL;
+  ob->direct = fcntl (fd, F_GETFL) & O_DIRECT ? 1 : 0;
+
+  if (use_uring && ob->direct)
+    {
+      fprintf (stderr, "warning: io_uring can't be used with direct I/O, "
+	       "writing synchronously\n\n");
+      use_uring = 0;
+    }
+
+  if (use_uring)
+    {
+      ob->ring = setup_uring ();
+
+      if (!ob->ring)
+	fprintf (stderr, "warning: io_uring is not available, writing "
+		 "synchronously\n\n");
+    }
+
+  ob->buf = ob->ring ? ob->ring->buffers [0] : alloc_output_buffer ();
+  ob->size = OUTPUT_BUFFER_SIZE;
+  ob->used = 0;
+  ob->buf_offset = lseek (fd, 0, SEEK_CUR);
+
+  /* the offsets are only known for a file written from its start; one
+     that is appended to (>>) or already has data before this recording
+     gets no preallocation, writeback ranges or final truncation */
+
+  ob->writeback = ob->buf_offset == 0 && !(fcntl (fd, F_GETFL) & O_APPEND)
+    && !fstat (fd, &statbuf) && S_ISREG (statbuf.st_mode);
+
+  if (ob->buf_offset < 0)
+    ob->buf_offset = 0;
+
+  ob->prealloc_chunk = ob->writeback ? (off_t)prealloc_mb << 20 : 0;
+  ob->writeback = ob->writeback && !ob->direct;  /* no page cache involved */
+  ob->preallocated_to = ob->buf_offset;
+  ob->writeback_started_to = ob->writeback_done_to = ob->buf_offset;
+
+  ob->syscalls = 0;
+  ob->bytes = 0;
+  ob->syscall_time = 0;
+  ob->max_stall = 0;
+}
+
+
+void
+free_output_buffer (struct output_buffer *ob)
+{
+  struct uring *ring = ob->ring;
+  int i;
+
+  if (ring)
+    {
+      for (i = 0; i < URING_BUFFERS; i++)
+	free (ring->buffers [i]);
+
+      munmap (ring->sqes, ring->entries*sizeof (struct io_uring_sqe));
+
+      if (ring->cq_map != ring->sq_map)
+	munmap (ring->cq_map, ring->cq_map_size);
+
+      munmap (ring->sq_map, ring->sq_map_size);
+      close (ring->fd);
+      free (ring);
+    }
+  else
+    free (ob->buf);
+
+  if (ob->fd != STDOUT_FILENO)
+    close (ob->fd);
+}
+
+
+void
+write_fully (struct output_buffer *ob, const unsigned char *data, size_t sz)
+{
+  double start;
+  ssize_t ret;
+
+  while (sz)
+    {
+      start = get_time ();
+      ret = write (ob->fd, data, sz);
+      count_syscall (ob, start);
+
+      if (ret < 0 && errno == EINTR)
+	continue;
+
+      if (ret <= 0)
+	{
+	  fprintf (stderr, "couldn't write to output file: ");
+
+	  if (ret < 0)
+	    perror ("");
+	  else
+	    fprintf (stderr, "no progress\n");
+
+	  exit (1);
+	}
+
+      data += ret;
+      sz -= ret;
+      ob->bytes += ret;
+    }
+}
+
+
+void
+reserve_output_space (struct output_buffer *ob, off_t end)
+{
+  double start;
+
+  /* allocating the file in big chunks keeps it contiguous; the size is
+     kept, so the file stays valid and the rest is freed at the end */
+
+  while (ob->prealloc_chunk && ob->preallocated_to < end)
+    {
+      start = get_time ();
+
+      if (fallocate (ob->fd, FALLOC_FL_KEEP_SIZE, ob->preallocated_to,
+		     ob->prealloc_chunk) < 0)
+	{
+	  fprintf (stderr, "warning: couldn't preallocate output file: %s\n",
+		   strerror (errno));
+	  ob->prealloc_chunk = 0;
+	}
+
+      count_syscall (ob, start);
+      ob->preallocated_to += ob->prealloc_chunk;
+    }
+}
+
+
+void
+control_writeback (struct output_buffer *ob)
+{
+  struct uring_write *wr;
+  off_t completed = ob->buf_offset;
+  double start;
+
+  if (!ob->writeback)
+    return;
+
+  if (ob->ring)
+    {
+      for (wr = ob->ring->in_flight; wr; wr = wr->next)
+	{
+	  if (wr->buffer >= 0 && wr->offset < completed)
+	    completed = wr->offset;
+	}
+    }
+
+  if (completed-ob->writeback_started_to < WRITEBACK_WINDOW)
+    return;
+
+  /* start writeback of the newly completed window, then wait for the
+     previous one, which by now has normally reached the disk; this keeps
+     dirty pages from piling up into a big stall later */
+
+  if (ob->ring)
+    {
+      /* with io_uring the waiting happens in the kernel's workers, so the
+	 encode loop never blocks on the disk here */
+
+      queue_uring_sync_range (ob, ob->writeback_started_to,
+			      completed-ob->writeback_started_to,
+			      SYNC_FILE_RANGE_WRITE);
+
+      if (ob->writeback_started_to > ob->writeback_done_to)
+	queue_uring_sync_range (ob, ob->writeback_done_to,
+				ob->writeback_started_to
+				-ob->writeback_done_to,
+				SYNC_FILE_RANGE_WAIT_BEFORE
+				| SYNC_FILE_RANGE_WRITE
+				| SYNC_FILE_RANGE_WAIT_AFTER);
+
+      enter_uring (ob, 0);
+    }
+  else
+    {
+      start = get_time ();
+
+      sync_file_range (ob->fd, ob->writeback_started_to,
+		       completed-ob->writeback_started_to,
+		       SYNC_FILE_RANGE_WRITE);
+
+      if (ob->writeback_started_to > ob->writeback_done_to)
+	sync_file_range (ob->fd, ob->writeback_done_to,
+			 ob->writeback_started_to-ob->writeback_done_to,
+			 SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+			 | SYNC_FILE_RANGE_WAIT_AFTER);
+
+      count_syscall (ob, start);
+    }
+
+  ob->writeback_done_to = ob->writeback_started_to;
+  ob->writeback_started_to = completed;
+}
+
+
+void
+flush_output_buffer (struct output_buffer *ob)
+{
+  size_t sz;
+
+  reserve_output_space (ob, ob->buf_offset+ob->used);
+
+  if (ob->ring)
+    uring_flush (ob);
+  else if (ob->direct)
+    {
+      /* only whole blocks go out, the partial one at the end stays in the
+	 buffer so that buf_offset remains aligned */
+
+      sz = ob->used/DIRECT_IO_BLOCK*DIRECT_IO_BLOCK;
+      write_fully (ob, ob->buf, sz);
+
+      memmove (ob->buf, ob->buf+sz, ob->used-sz);
+      ob->buf_offset += sz;
+      ob->used -= sz;
+
+      /* the partial block goes out too, padded with zeroes, so that what
+	 was flushed is on the disk; the next flush writes it again with
+	 more data, and recovery stops at the padding */
+
+      if (ob->used)
+	{
+	  memset (ob->buf+ob->used, 0, DIRECT_IO_BLOCK-ob->used);
+	  write_fully (ob, ob->buf, DIRECT_IO_BLOCK);
+	  ob->bytes -= DIRECT_IO_BLOCK;
+
+	  if (lseek (ob->fd, ob->buf_offset, SEEK_SET) < 0)
+	    {
+	      fprintf (stderr, "couldn't seek in output file: ");
+	      perror ("");
+	      exit (1);
+	    }
+	}
+    }
+  else
+    {
+      write_fully (ob, ob->buf, ob->used);
+
+      ob->buf_offset += ob->used;
+      ob->used = 0;
+    }
+
+  control_writeback (ob);
+}
+
+
+void
+finish_output (struct output_buffer *ob)
+{
+  size_t tail;
+
+  flush_output_buffer (ob);
+
+  if (ob->direct && ob->used)
+    {
+      /* the flush wrote the last partial block padded with zeroes, the
+	 padding is cut away by the truncation below */
+
+      tail = ob->used;
+      ob->bytes += tail;
+
+      ob->buf_offset += tail;
+      ob->used = 0;
+
+      if (ftruncate (ob->fd, ob->buf_offset) < 0)
+	{
+	  fprintf (stderr, "couldn't truncate output file: ");
+	  perror ("");
+	}
+    }
+
+  if (ob->ring)
+    {
+      while (ob->ring->pending_patches || ob->ring->in_flight)
+	{
+	  enter_uring (ob, 1);
+	  reap_uring (ob);
+	}
+
+      queue_uring_fsync (ob, 1);
+
+      while (ob->ring->busy)
+	{
+	  enter_uring (ob, 1);
+	  reap_uring (ob);
+	}
+    }
+
+  if (ob->preallocated_to > ob->buf_offset
+      && ftruncate (ob->fd, ob->buf_offset) < 0)
+    {
+      fprintf (stderr, "couldn't truncate output file: ");
+      perror ("");
+    }
+}
+
+
+off_t
+output_position (struct output_buffer *ob)
+{
+  return ob->buf_offset+ob->used;
+}
+
+
+void
+write_bytes (struct output_buffer *ob, const void *data, size_t sz)
+{
+  const unsigned char *d = data;
+  size_t n;
+
+  if (ob->used+sz > ob->size)
+    flush_output_buffer (ob);
+
+  if (sz >= ob->size && !ob->ring && !ob->direct)  /* skip the copy */
+    {
+      reserve_output_space (ob, ob->buf_offset+sz);
+      write_fully (ob, data, sz);
+      ob->buf_offset += sz;
+      control_writeback (ob);
+      return;
+    }
+
+  while (sz)
+    {
+      n = sz < ob->size-ob->used ? sz : ob->size-ob->used;
+      memcpy (ob->buf+ob->used, d, n);
+      ob->used += n;
+      d += n;
+      sz -= n;
+
+      if (sz)
+	flush_output_buffer (ob);
+    }
+}
+
+
+void
+write_char (struct output_buffer *ob, int ch)
+{
+  if (ob->used == ob->size)
+    flush_output_buffer (ob);
+
+  ob->buf [ob->used++] = ch & 0xff;
+}
+
+
+void
+write_int32_bigend (struct output_buffer *ob, int num)
+{
+  unsigned char b [4] = {(num >> 24) & 0xff, (num >> 16) & 0xff,
+			 (num >> 8) & 0xff, num & 0xff};
+
+  write_bytes (ob, b, 4);
+}
+
+
+void
+write_int64_bigend (struct output_buffer *ob, long num)
+{
+  write_int32_bigend (ob, (num & 0xffffffff00000000) >> 32);
+  write_int32_bigend (ob, num);
+}
+
+
+void
+patch_direct (struct output_buffer *ob, off_t pos, const void *data, size_t sz)
+{
+  off_t start = pos/DIRECT_IO_BLOCK*DIRECT_IO_BLOCK;
+  size_t len = (pos+sz-start+DIRECT_IO_BLOCK-1)/DIRECT_IO_BLOCK
+    *DIRECT_IO_BLOCK;
+  unsigned char *block;
+  double t = get_time ();
+
+  /* O_DIRECT can't write a few bytes, so the blocks holding them are
+     read back, patched and rewritten */
+
+  if (posix_memalign ((void **)&block, DIRECT_IO_BLOCK, len))
+    {
+      fprintf (stderr, "could not allocate %lu bytes.  Exiting...\n", len);
+      exit (1);
+    }
+
+  if (pread (ob->fd, block, len, start) != len)
+    {
+      fprintf (stderr, "couldn't read back output file: ");
+      perror ("");
+      exit (1);
+    }
+
+  memcpy (block+(pos-start), data, sz);
+
+  if (pwrite (ob->fd, block, len, start) != len)
+    {
+      fprintf (stderr, "couldn't write to output file: ");
+      perror ("");
+      exit (1);
+    }
+
+  count_syscall (ob, t);
+  ob->syscalls++;
+
+  free (block);
+}
+
+
+void
+patch_output (struct output_buffer *ob, off_t pos, const void *data, size_t sz)
+{
+  const unsigned char *d = data;
+  size_t infile;
+  double start;
+
+  /* the part of the target still in the buffer is patched in place, the
+     rest was already written out and needs a pwrite */
+
+  if (pos < ob->buf_offset)
+    {
+      infile = pos+sz <= ob->buf_offset ? sz : ob->buf_offset-pos;
+
+      if (ob->ring)
+	uring_patch (ob, pos, d, infile);
+      else if (ob->direct)
+	patch_direct (ob, pos, d, infile);
+      else
+	{
+	  start = get_time ();
+
+	  if (pwrite (ob->fd, d, infile, pos) != infile)
+	    {
+	      fprintf (stderr, "couldn't write to output file: ");
+	      perror ("");
+	      exit (1);
+	    }
+
+	  count_syscall (ob, start);
+	}
+
+      d += infile;
+      pos += infile;
+      sz -= infile;
+    }
+
+  if (sz)
+    memcpy (ob->buf+(pos-ob->buf_offset), d, sz);
+}
+
+
+void
+patch_int32_bigend (struct output_buffer *ob, off_t pos, int num)
+{
+  unsigned char b [4] = {(num >> 24) & 0xff, (num >> 16) & 0xff,
+			 (num >> 8) & 0xff, num & 0xff};
+
+  patch_output (ob, pos, b, 4);
+}
+
+
+void
+patch_int64_bigend (struct output_buffer *ob, off_t pos, long num)
+{
+  unsigned char b [8];
+
+  store_int64_bigend (b, num);
+  patch_output (ob, pos, b, 8);
+}
+
+
+void
+print_output_stats (struct output_buffer *ob, long frames, double elapsed)
+{
+  fprintf (stderr, "wrote %lld bytes with %ld syscalls (%.2f per frame), "
+	   "%s output blocked for %.3f s (longest stall %.2f ms), "
+	   "%.1f MB/s overall\n", ob->bytes, ob->syscalls,
+	   frames ? (double)ob->syscalls/frames : 0.0,
+	   ob->ring ? "io_uring" : "synchronous", ob->syscall_time,
+	   ob->max_stall*1000, elapsed > 0 ? ob->bytes/elapsed/1000000 : 0.0);
+}
+
+
+struct
+mem_writer  /* builds nested mp4 boxes or ebml elements in memory */
+{
+  unsigned char *buf;
+  size_t used, size;
+
+  size_t open [8];
+  int depth;
+};
+
+
+void
+mem_grow (struct mem_writer *mw, size_t sz)  /* make room for sz more bytes */
+{
+  if (mw->used+sz > mw->size)
+    {
+      mw->size = (mw->used+sz)*2;
+      mw->buf = realloc (mw->buf, mw->size);
+
+      if (!mw->buf)
+	{
+	  fprintf (stderr, "could not allocate memory\n");
+	  exit (1);
+	}
+    }
+}
+
+
+void
+mem_put (struct mem_writer *mw, const void *data, size_t sz)
+{
+  mem_grow (mw, sz);
+  memcpy (mw->buf+mw->used, data, sz);
+  mw->used += sz;
+}
+
+
+void
+mem_put8 (struct mem_writer *mw, int num)
+{
+  unsigned char b = num;
+
+  mem_put (mw, &b, 1);
+}
+
+
+void
+mem_put16 (struct mem_writer *mw, int num)
+{
+  unsigned char b [2] = {(num >> 8) & 0xff, num & 0xff};
+
+  mem_put (mw, b, 2);
+}
+
+
+void
+mem_put32 (struct mem_writer *mw, unsigned long num)
+{
+  unsigned char b [4] = {(num >> 24) & 0xff, (num >> 16) & 0xff,
+			 (num >> 8) & 0xff, num & 0xff};
+
+  mem_put (mw, b, 4);
+}
+
+
+void
+mem_put64 (struct mem_writer *mw, long num)
+{
+  unsigned char b [8];
+
+  store_int64_bigend (b, num);
+  mem_put (mw, b, 8);
+}
+
+
+unsigned char *
+next_nal (unsigned char **start_code, unsigned char *end, long *nal_size)
+{
+  unsigned char *nal = *start_code;
+
+  if (!nal)
+    return NULL;
+
+  nal += 3;
+  *start_code = memmem (nal, end-nal, "\0\0\1", 3);
+  *nal_size = (*start_code ? *start_code : end)-nal;
+
+  while (*nal_size && !nal [*nal_size-1])
+    (*nal_size)--;  /* trailing zeroes belong to the next start code */
+
+  return nal;
+}
+
+
+long
+nal_lengths_size (unsigned char *payload, int size)
+{
+  unsigned char *start_code = memmem (payload, size, "\0\0\1", 3);
+  long nal_size, total = 0;
+
+  while (next_nal (&start_code, payload+size, &nal_size))
+    total += 4+nal_size;
+
+  return total;
+}
+
+
+void
+mem_put_nal_lengths (struct mem_writer *mw, unsigned char *payload, int size)
+{
+  unsigned char *start_code = memmem (payload, size, "\0\0\1", 3), *nal,
+    b [4];
+  long nal_size;
+
+  /* annex b start codes become 4-byte lengths, as mp4 and matroska want
+     for h.264 */
+
+  while ((nal = next_nal (&start_code, payload+size, &nal_size)))
+    {
+      store_int32_bigend (b, nal_size);
+      mem_put (mw, b, 4);
+      mem_put (mw, nal, nal_size);
+    }
+}
+
+
+unsigned char *
+strip_start_code (unsigned char *nal, int *size)
+{
+  int i;
+
+  for (i = 0; i < *size-1 && !nal [i]; i++)
+    ;
+
+  if (i >= 2 && nal [i] == 1)
+    {
+      *size -= i+1;
+      return nal+i+1;
+    }
+
+  return nal;
+}
+
+
+unsigned
+read_exp_golomb (const unsigned char *buf, int len, int *bitpos)
+{
+  unsigned val = 0;
+  int zeros = 0, i;
+
+  while (*bitpos < len*8 && !(buf [*bitpos/8] & (0x80 >> *bitpos%8))
+	 && zeros < 31)
+    {
+      zeros++;
+      (*bitpos)++;
+    }
+
+  (*bitpos)++;
+
+  for (i = 0; i < zeros && *bitpos < len*8; i++, (*bitpos)++)
+    val = val << 1 | ((buf [*bitpos/8] >> (7-*bitpos%8)) & 1);
+
+  return (1U << zeros)-1+val;
+}
+
+
+void
+mem_put_avc_config (struct mem_writer *mw, x264_nal_t headers [],
+		    int headers_num)
+{
+  unsigned char *sps = NULL, *pps = NULL,
+    high_profiles [] = {100, 110, 122, 244, 44, 83, 86, 118, 128, 138, 139,
+			134, 135};
+  int i, sps_sz = 0, pps_sz = 0, bitpos, chroma_format, luma_depth,
+    chroma_depth;
+
+  for (i = 0; i < headers_num; i++)
+    {
+      if (headers [i].i_type == NAL_SPS)
+	{
+	  sps_sz = headers [i].i_payload;
+	  sps = strip_start_code (headers [i].p_payload, &sps_sz);
+	}
+      else if (headers [i].i_type == NAL_PPS)
+	{
+	  pps_sz = headers [i].i_payload;
+	  pps = strip_start_code (headers [i].p_payload, &pps_sz);
+	}
+    }
+
+  if (!sps || !pps || sps_sz < 4 || sps_sz > 0xffff || pps_sz > 0xffff)
+    {
+      fprintf (stderr, "couldn't configure x264 encoder\n");
+      exit (1);
+    }
+
+  mem_put8 (mw, 1);  /* configuration version */
+  mem_put (mw, sps+1, 3);  /* profile, constraints and level */
+  mem_put8 (mw, 0xff);  /* 4-byte nal lengths */
+  mem_put8 (mw, 0xe1);
+  mem_put16 (mw, sps_sz);
+  mem_put (mw, sps, sps_sz);
+  mem_put8 (mw, 1);
+  mem_put16 (mw, pps_sz);
+  mem_put (mw, pps, pps_sz);
+
+  /* high profiles also carry chroma format and bit depths, which come
+     right after the sps id */
+
+  if (memchr (high_profiles, sps [1], sizeof (high_profiles)))
+    {
+      bitpos = 32;
+      read_exp_golomb (sps, sps_sz, &bitpos);
+      chroma_format = read_exp_golomb (sps, sps_sz, &bitpos);
+
+      if (chroma_format == 3)
+	bitpos++;  /* separate colour plane flag */
+
+      luma_depth = read_exp_golomb (sps, sps_sz, &bitpos);
+      chroma_depth = read_exp_golomb (sps, sps_sz, &bitpos);
+
+      mem_put8 (mw, 0xfc | (chroma_format & 3));
+      mem_put8 (mw, 0xf8 | (luma_depth & 7));
+      mem_put8 (mw, 0xf8 | (chroma_depth & 7));
+      mem_put8 (mw, 0);  /* no sps extensions */
+    }
+}
+
+
+#define EBML_SIZE8(size) (0x0100000000000000 | (size))  /* 8-byte size field */
+
+#define EBML_UNKNOWN_SIZE8 0x01ffffffffffffff
+
+#define CUES_SEEK_SIZE 21  /* a seek of cues, with an 8-byte position */
+
+#define CHECKPOINT_RESERVE (64 << 10)  /* room for about 2000 cues */
+
+/* a cue point with the longest possible fields: its id and size, then
+   the timestamp, the track positions and their track, cluster position
+   and relative position, each with a one-byte id and size */
+
+#define CUE_POINT_MAX (2+(2+8)+2+(2+1)+(2+8)+(2+8))
+
+
+int
+ebml_id_length (unsigned long id)
+{
+  return id > 0xffffff ? 4 : id > 0xffff ? 3 : id > 0xff ? 2 : 1;
+}
+
+
+int
+ebml_size_length (unsigned long size)
+{
+  int len = 1;
+
+  /* a size with all value bits set would mean unknown */
+
+  while (len < 8 && size >= (1UL << 7*len)-1)
+    len++;
+
+  return len;
+}
+
+
+void
+store_ebml_size (unsigned char *b, unsigned long size, int len)
+{
+  int i;
+
+  for (i = len-1; i >= 0; i--, size >>= 8)
+    b [i] = size & 0xff;
+
+  b [0] |= 0x80 >> (len-1);
+}
+
+
+void
+mem_put_ebml_id (struct mem_writer *mw, unsigned long id)
+{
+  int len = ebml_id_length (id);
+
+  while (len--)
+    mem_put8 (mw, (id >> 8*len) & 0xff);
+}
+
+
+void
+mem_put_ebml_size (struct mem_writer *mw, unsigned long size)
+{
+  unsigned char b [8];
+  int len = ebml_size_length (size);
+
+  store_ebml_size (b, size, len);
+  mem_put (mw, b, len);
+}
+
+
+void
+mem_put_ebml_uint (struct mem_writer *mw, unsigned long id, unsigned long num)
+{
+  int len = 1;
+
+  while (len < 8 && num >> 8*len)
+    len++;
+
+  mem_put_ebml_id (mw, id);
+  mem_put_ebml_size (mw, len);
+
+  while (len--)
+    mem_put8 (mw, (num >> 8*len) & 0xff);
+}
+
+
+void
+mem_put_ebml_binary (struct mem_writer *mw, unsigned long id,
+		     const void *data, size_t sz)
+{
+  mem_put_ebml_id (mw, id);
+  mem_put_ebml_size (mw, sz);
+  mem_put (mw, data, sz);
+}
+
+
+void
+mem_put_ebml_string (struct mem_writer *mw, unsigned long id, const char *str)
+{
+  mem_put_ebml_binary (mw, id, str, strlen (str));
+}
+
+
+void
+fill_void (unsigned char *buf, size_t sz)  /* sz must be at least 2 */
+{
+  memset (buf, 0, sz);
+  buf [0] = 0xec;
+
+  if (sz < 9)
+    buf [1] = 0x80 | (sz-2);
+  else
+    store_int64_bigend (buf+1, EBML_SIZE8 (sz-9));
+}
+
+
+void
+mem_put_ebml_void (struct mem_writer *mw, size_t sz)
+{
+  mem_grow (mw, sz);
+  fill_void (mw->buf+mw->used, sz);
+  mw->used += sz;
+}
+
+
+void
+ebml_open (struct mem_writer *mw, unsigned long id)
+{
+  mem_put_ebml_id (mw, id);
+  mw->open [mw->depth++] = mw->used;
+  mem_put64 (mw, 0);  /* room for the longest size, see ebml_close */
+}
+
+
+void
+ebml_close (struct mem_writer *mw)
+{
+  size_t start = mw->open [--mw->depth], body = mw->used-start-8;
+  int len = ebml_size_length (body);
+
+  /* now that the size is known it takes as few bytes as possible, and
+     the body moves back over the rest; this is only for the small
+     header elements, blocks know their size before they are written */
+
+  store_ebml_size (mw->buf+start, body, len);
+  memmove (mw->buf+start+len, mw->buf+start+8, body);
+  mw->used -= 8-len;
+}
+
+
+void
+mem_put_ebml_seek (struct mem_writer *mw, unsigned long id, off_t position)
+{
+  ebml_open (mw, 0x4dbb);  /* seek */
+  ebml_open (mw, 0x53ab);  /* seek id */
+  mem_put_ebml_id (mw, id);
+  ebml_close (mw);
+  mem_put_ebml_uint (mw, 0x53ac, position);  /* seek position */
+  ebml_close (mw);
+}
+
+
+void
+fill_cues_seek (unsigned char *buf, off_t cues_position)
+{
+  unsigned char seek []
+    = {0x4d, 0xbb, 0x92, /* seek of cues */
+       0x53, 0xab, 0x84, 0x1c, 0x53, 0xbb, 0x6b, /* seek id of cues */
+       0x53, 0xac, 0x88}; /* seek position of cues */
+
+  /* this one keeps a fixed length, so that it can take the place of the
+     void reserved for it */
+
+  memcpy (buf, seek, sizeof (seek));
+  store_int64_bigend (buf+sizeof (seek), cues_position);
+}
+
+
+void
+add_cue (struct cue_vector **cuevec, int *cueind, long timestamp,
+	 off_t cluster_position, off_t relative_position)
+{
+  if (*cueind == CUE_VECTOR_SIZE)
+    {
+      (*cuevec)->next = malloc_and_check (sizeof (*(*cuevec)->next));
+      *cuevec = (*cuevec)->next;
+      (*cuevec)->next = NULL;
+      *cueind = 0;
+    }
+
+  (*cuevec)->cues [*cueind].timestamp = timestamp;
+  (*cuevec)->cues [*cueind].cluster_position = cluster_position;
+  (*cuevec)->cues [*cueind].relative_position = relative_position;
+  (*cueind)++;
+}
+
+
+unsigned char *
+make_cues (struct cue_vector *cuevec, int last_cueind, size_t *size)
+{
+  struct mem_writer mw = {0};
+  struct cue_vector *v;
+  int i;
+
+  ebml_open (&mw, 0x1c53bb6b);  /* cues */
+
+  for (v = cuevec; v; v = v->next)
+    {
+      for (i = 0; i < (v->next ? CUE_VECTOR_SIZE : last_cueind); i++)
+	{
+	  ebml_open (&mw, 0xbb);  /* cue point */
+	  mem_put_ebml_uint (&mw, 0xb3, v->cues [i].timestamp);
+	  ebml_open (&mw, 0xb7);  /* cue track positions */
+	  mem_put_ebml_uint (&mw, 0xf7, 1);  /* cue track */
+	  mem_put_ebml_uint (&mw, 0xf1, v->cues [i].cluster_position);
+	  mem_put_ebml_uint (&mw, 0xf0, v->cues [i].relative_position);
+	  ebml_close (&mw);
+	  ebml_close (&mw);
+	}
+    }
+
+  ebml_close (&mw);
+
+  *size = mw.used;
+  return mw.buf;
+}
+
+
+
+
+sem_t *may_start;
+sem_t has_finished;
+
+
+void
+mark_dirty_row (struct thread_args *arg, int row, int off)
+{
+  unsigned char *a = arg->out+off, *b = arg->prev+off;
+  int l = 0, r = arg->w*3;
+
+  if (!memcmp (a, b, r))
+    return;
+
+  while (a [l] == b [l])
+    l++;
+
+  while (a [r-1] == b [r-1])
+    r--;
+
+  if (arg->dirty_x1 == arg->dirty_x0)  /* first change in the strip */
+    {
+      arg->dirty_x0 = l/3;
+      arg->dirty_x1 = (r+2)/3;
+      arg->dirty_y0 = row;
+    }
+  else
+    {
+      if (l/3 < arg->dirty_x0)
+	arg->dirty_x0 = l/3;
+
+      if ((r+2)/3 > arg->dirty_x1)
+	arg->dirty_x1 = (r+2)/3;
+    }
+
+  arg->dirty_y1 = row+1;
+}
+
+
+#define TILE_WIDTH 64  /* in pixels, tiles are as high as a strip */
+
+
+struct
+strip_delta
+{
+  unsigned char *prev;  /* last frame sent, NULL to send every tile */
+  unsigned char *raw, *packed;
+  unsigned long packed_size, packed_len;
+};
+
+
+void
+pack_strip_delta (struct thread_args *arg, int row, int rows)
+{
+  struct strip_delta *d = arg->delta;
+  int tiles = (arg->w+TILE_WIDTH-1)/TILE_WIDTH, t, j, tw, changed = 0;
+  size_t stride = arg->w*3, off;
+  unsigned char *p = d->raw+tiles;
+  uLongf len = d->packed_size;
+
+  /* a byte per tile tells whether it changed since the last frame, then
+     come the rows of the changed tiles; the whole is deflated at the
+     fastest level, since the client has little time to spare */
+
+  for (t = 0; t < tiles && rows > 0; t++)
+    {
+      tw = (t < tiles-1 ? TILE_WIDTH : arg->w-t*TILE_WIDTH)*3;
+      off = row*stride+t*TILE_WIDTH*3;
+
+      for (j = 0; d->prev && j < rows
+	     && !memcmp (arg->out+off+j*stride, d->prev+off+j*stride, tw); j++);
+
+      d->raw [t] = !d->prev || j < rows;
+
+      if (!d->raw [t])
+	continue;
+
+      for (j = 0; j < rows; j++, p += tw)
+	memcpy (p, arg->out+off+j*stride, tw);
+
+      changed = 1;
+    }
+
+  if (!changed)
+    {
+      d->packed_len = 0;
+      return;
+    }
+
+  if (compress2 (d->packed, &len, d->raw, p-d->raw, Z_BEST_SPEED) != Z_OK)
+    {
+      fprintf (stderr, "couldn't compress frame\n");
+      exit (1);
+    }
+
+  d->packed_len = len;
+}
+
+
+void *
+rearrange_rows (void *args)
+{
+  struct thread_args *arg = args;
+  int destind, j, striph = ceil ((double)arg->h/arg->total);
+
+
+  /*fprintf (stderr, "thread %d started, strips are %d high\n", arg->index, striph);*/
+
+  for (;;)
+    {
+      /*fprintf (stderr, "thread %d waiting for may_start semaphore\n", arg->index);*/
+      sem_wait (&may_start [arg->index]);
+      /*fprintf (stderr, "thread %d got may_start semaphore\n", arg->index);*/
+
+      destind = arg->index*striph*arg->w*3;
+      arg->dirty_x0 = arg->dirty_y0 = arg->dirty_x1 = arg->dirty_y1 = 0;
+
+      for (j = arg->y+arg->index*striph; j < arg->y+(arg->index+1)*striph
+	     && j < arg->y+arg->h; j++)
+	{
+	  convert_tiledx4kb_row (arg->out+destind, (unsigned char *)arg->in,
+				 arg->x, j, arg->w, arg->p);
+	  destind += arg->w*3;
+
+	  if (arg->prev)
+	    mark_dirty_row (arg, j-arg->y, destind-arg->w*3);
+	}
+
+      if (arg->delta)
+	pack_strip_delta (arg, arg->index*striph,
+			  arg->h-arg->index*striph < striph
+			  ? arg->h-arg->index*striph : striph);
+
+      /*fprintf (stderr, "thread %d posting has_finished semaphore\n", arg->index);*/
+      sem_post (&has_finished);
+    }
+
+  fprintf (stderr, "thread %d finished\n", arg->index);
+
+  return NULL;
+}
+
+
+struct
+recording_options
+{
+  char *output, *preset;
+  int recording_interval;
+  int timestamp_scale;  /* in nanoseconds */
+  int cue_interval;  /* in seconds, zero for a cue at every keyframe */
+  int use_uring, prealloc_mb, direct_io;
+  int segment_time;  /* in seconds, zero for no rotation */
+  long segment_size;  /* in bytes, zero for no rotation */
+  int replay_time;  /* in seconds, zero to record everything */
+  long replay_size;  /* in bytes, zero for the default */
+  int checkpoint_interval;  /* in seconds, zero for no cue checkpoints */
+  int front_cues_time;  /* in seconds, zero to write cues only at the end */
+  int ring_slots;  /* frames kept in shared memory, zero for none */
+  char *publish_to;  /* a file for that memory instead of a memfd */
+  char *capture_to;  /* only capture into a ring in this file */
+  char *send_to;  /* only capture and send to these encode workers */
+  int gop_time;  /* in seconds, how much each worker gets in a row */
+  enum output_format format;
+  char *udp_dest;  /* send mpeg-ts there instead of writing a file */
+  int rtp;
+  int burst;  /* screenshots to take into numbered files, zero for one */
+  int burst_interval;  /* in vblanks, or in milliseconds */
+  int burst_interval_ms;
+};
+
+
+struct
+mp4_sample
+{
+  int size, flags;
+  long pts, dts;
+};
+
+
+struct
+muxer
+{
+  enum output_format format;
+  struct output_buffer ob;
+  char *filename;
+  int streaming;
+
+  off_t segment_size_pos, segment_body, cues_seek_pos, cluster_pos;
+  struct mem_writer cluster;  /* body of the cluster in progress */
+  long timestamp_offset, timestamp_of_cluster, last_cue_timestamp,
+    cue_distance;
+
+  struct cue_vector cue_vectors, *cuevec;
+  int cueind;
+
+  off_t front_cues_pos;  /* void reserved for cues after the header */
+  long front_cues_size;
+  long checkpoint_distance, last_checkpoint;
+  int checkpointed;
+
+  /* fragmented mp4 only: the GOP being collected for the next fragment */
+  struct mp4_sample *samples;
+  int samples_num, samples_size;
+  struct mem_writer frag;
+  long default_duration;
+  unsigned fragments;
+
+  /* mpeg-ts only: the packets of the current frame */
+  unsigned char *ts_data;
+  size_t ts_used, ts_size;
+  unsigned char *parameter_sets;  /* sps and pps, sent with keyframes */
+  int parameter_sets_size;
+  int continuity [3], timestamp_scale;
+  int sock, rtp;
+  unsigned short rtp_seq;
+  unsigned rtp_ssrc;
+  long datagrams, dropped;
+
+  long frames_written;
+  double start_time;
+};
+
+
+int
+open_output_file (char *filename, int direct_io)
+{
+  int fd;
+
+  if (!filename || !strcmp (filename, "-"))
+    fd = STDOUT_FILENO;
+  else
+    {
+      fd = open (filename, O_RDWR | O_CREAT | O_TRUNC
+		 | (direct_io ? O_DIRECT : 0), 0644);
+
+      if (fd < 0 && direct_io && errno == EINVAL)
+	{
+	  fprintf (stderr, "warning: direct I/O is not supported for %s, "
+		   "using the page cache\n\n", filename);
+	  fd = open (filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	}
+    }
+
+  if (fd < 0)
+    {
+      fprintf (stderr, "couldn't open %s: ", filename);
+      perror ("");
+      exit (1);
+    }
+
+  if (isatty (fd))
+    {
+      fprintf (stderr, "refusing to write a recording to a terminal, use -o "
+	       "or redirect standard output\n");
+      exit (1);
+    }
+
+  return fd;
+}
+
+
+char *
+make_segment_filename (char *output, int num)
+{
+  char *dot = strrchr (output, '.'), *slash = strrchr (output, '/'), *ret;
+  int baselen;
+
+  if (!dot || (slash && dot < slash))
+    dot = output+strlen (output);
+
+  baselen = dot-output;
+  ret = malloc_and_check (strlen (output)+16);
+  sprintf (ret, "%.*s-%04d%s", baselen, output, num, dot);
+
+  return ret;
+}
+
+
+void
+open_muxer_output (struct muxer *mux, char *filename,
+		   struct recording_options *opts)
+{
+  int fd = open_output_file (filename, opts->direct_io);
+
+  mux->format = opts->format;
+  mux->filename = filename;
+
+  /* patches are written at offsets from the start of the file, so an
+     output that is appended to (>>) or that doesn't start at offset zero
+     gets the same stream as a pipe */
+
+  mux->streaming = lseek (fd, 0, SEEK_CUR) != 0
+    || fcntl (fd, F_GETFL) & O_APPEND;
+
+  init_output_buffer (&mux->ob, fd, opts->use_uring && !mux->streaming,
+		      opts->prealloc_mb);
+
+  mux->timestamp_offset = -1;
+  mux->frames_written = 0;
+  mux->start_time = get_time ();
+}
+
+
+void
+write_matroska_header (struct muxer *mux, int width, int height,
+		       int default_duration, int timestamp_scale,
+		       x264_nal_t headers [], int headers_num,
+		       long cues_reserve)
+{
+  struct mem_writer mw = {0}, avcc = {0};
+  off_t base = output_position (&mux->ob), info_pos, tracks_pos;
+
+
+  ebml_open (&mw, 0x1a45dfa3);  /* ebml header */
+  mem_put_ebml_uint (&mw, 0x4286, 1);  /* ebml version */
+  mem_put_ebml_uint (&mw, 0x42f7, 1);  /* ebml read version */
+  mem_put_ebml_uint (&mw, 0x42f2, 4);  /* max id length */
+  mem_put_ebml_uint (&mw, 0x42f3, 8);  /* max size length */
+  mem_put_ebml_string (&mw, 0x4282, "matroska");  /* doc type */
+  mem_put_ebml_uint (&mw, 0x4287, 4);  /* doc type version */
+  mem_put_ebml_uint (&mw, 0x4285, 2);  /* doc type read version */
+  ebml_close (&mw);
+
+  /* the segment has an unknown size until the recording is finished, and
+     its size field has room for any size */
+
+  mem_put_ebml_id (&mw, 0x18538067);
+  mux->segment_size_pos = base+mw.used;
+  mem_put64 (&mw, EBML_UNKNOWN_SIZE8);
+  mux->segment_body = base+mw.used;
+
+  info_pos = base+mw.used;
+  ebml_open (&mw, 0x1549a966);  /* info */
+  mem_put_ebml_uint (&mw, 0x2ad7b1, timestamp_scale);
+  mem_put_ebml_string (&mw, 0x4d80, "screenrec");  /* muxing app */
+  mem_put_ebml_string (&mw, 0x5741, "screenrec");  /* writing app */
+  ebml_close (&mw);
+
+  mem_put_avc_config (&avcc, headers, headers_num);
+
+  tracks_pos = base+mw.used;
+  ebml_open (&mw, 0x1654ae6b);  /* tracks */
+  ebml_open (&mw, 0xae);  /* track entry */
+  mem_put_ebml_uint (&mw, 0xd7, 1);  /* track number */
+  mem_put_ebml_uint (&mw, 0x73c5, 1);  /* track uid */
+  mem_put_ebml_uint (&mw, 0x83, 1);  /* track type, video */
+  mem_put_ebml_uint (&mw, 0x23e383, default_duration);
+  mem_put_ebml_string (&mw, 0x86, "V_MPEG4/ISO/AVC");  /* codec id */
+  mem_put_ebml_binary (&mw, 0x63a2, avcc.buf, avcc.used);  /* codec private */
+  ebml_open (&mw, 0xe0);  /* video settings */
+  mem_put_ebml_uint (&mw, 0xb0, width);
+  mem_put_ebml_uint (&mw, 0xba, height);
+  ebml_close (&mw);
+  ebml_close (&mw);
+  ebml_close (&mw);
+  free (avcc.buf);
+
+  /* the seek of cues stays a void until there are cues to point to, so
+     that the file is valid even if we never get to write them */
+
+  ebml_open (&mw, 0x114d9b74);  /* seek head */
+  mem_put_ebml_seek (&mw, 0x1549a966, info_pos-mux->segment_body);
+  mem_put_ebml_seek (&mw, 0x1654ae6b, tracks_pos-mux->segment_body);
+  mem_put_ebml_void (&mw, CUES_SEEK_SIZE);
+  ebml_close (&mw);
+
+  mux->cues_seek_pos = base+mw.used-CUES_SEEK_SIZE;
+
+  if (cues_reserve)
+    {
+      mux->front_cues_pos = base+mw.used;
+      mux->front_cues_size = cues_reserve;
+      mem_put_ebml_void (&mw, cues_reserve);
+    }
+
+  write_bytes (&mux->ob, mw.buf, mw.used);
+  free (mw.buf);
+}
+
+
+long
+front_cues_reserve (struct recording_options *opts)
+{
+  long duration = opts->front_cues_time, cues_num, size;
+
+  /* a file never lasts longer than a segment or the replay buffer */
+
+  if (opts->segment_time && opts->segment_time < duration)
+    duration = opts->segment_time;
+
+  if (opts->replay_time && opts->replay_time < duration)
+    duration = opts->replay_time;
+
+  /* with no cue interval there is a cue at every keyframe, and x264
+     rarely puts them closer than a second */
+
+  cues_num = duration/(opts->cue_interval ? opts->cue_interval : 1)+1;
+  size = 16+cues_num*CUE_POINT_MAX;
+
+  if (opts->checkpoint_interval && size < CHECKPOINT_RESERVE)
+    size = CHECKPOINT_RESERVE;
+
+  return duration || opts->checkpoint_interval ? size : 0;
+}
+
+
+void
+start_matroska (struct muxer *mux, char *filename,
+		struct recording_options *opts, int width, int height,
+		int default_duration, x264_nal_t headers [], int headers_num)
+{
+  open_muxer_output (mux, filename, opts);
+
+  /* pipes and sockets can't be seeked back, so we write a live stream
+     made of unknown-size segment and clusters with no cues */
+
+  if (mux->streaming)
+    fprintf (stderr, "output is not seekable, writing a live stream with no "
+	     "cues\n\n");
+
+  /* cue checkpoints are rewritten from time to time in a void reserved
+     after the header, so that a crashed recording can still be seeked;
+     the final cues go there too if they fit, so that players find them
+     without reading the end of the file */
+
+  mux->front_cues_pos = -1;
+  mux->checkpointed = 0;
+
+  write_matroska_header (mux, width, height, default_duration,
+			 opts->timestamp_scale, headers, headers_num,
+			 mux->streaming ? 0 : front_cues_reserve (opts));
+
+  mux->cue_distance = (double)opts->cue_interval*1000000000
+    /opts->timestamp_scale;
+
+  mux->checkpoint_distance = 0;
+
+  if (mux->front_cues_pos >= 0 && opts->checkpoint_interval)
+    {
+      mux->checkpoint_distance = (double)opts->checkpoint_interval
+	*1000000000/opts->timestamp_scale;
+      mux->last_checkpoint = 0;
+    }
+
+  mux->cluster_pos = -1;  /* the first cluster is opened by the first frame */
+  memset (&mux->cluster, 0, sizeof (mux->cluster));
+  mux->timestamp_of_cluster = 0;
+  mux->last_cue_timestamp = -1;
+
+  memset (&mux->cue_vectors, 0, sizeof (mux->cue_vectors));
+  mux->cuevec = &mux->cue_vectors;
+  mux->cueind = 0;
+}
+
+
+int
+write_front_cues (struct muxer *mux, unsigned char *cues, size_t size)
+{
+  unsigned char *region, seek [CUES_SEEK_SIZE];
+  long reserve = mux->front_cues_size;
+
+  /* what is left of the reserved room must still make a void */
+
+  if (size > reserve-2 && size != reserve)
+    return 0;
+
+  region = malloc_and_check (reserve);
+  memcpy (region, cues, size);
+
+  if (size < reserve)
+    fill_void (region+size, reserve-size);
+
+  patch_output (&mux->ob, mux->front_cues_pos, region, reserve);
+
+  if (!mux->checkpointed)
+    {
+      fill_cues_seek (seek, mux->front_cues_pos-mux->segment_body);
+      patch_output (&mux->ob, mux->cues_seek_pos, seek, CUES_SEEK_SIZE);
+      mux->checkpointed = 1;
+    }
+
+  free (region);
+  return 1;
+}
+
+
+void
+write_cue_checkpoint (struct muxer *mux)
+{
+  unsigned char *cues;
+  size_t size;
+
+  cues = make_cues (&mux->cue_vectors, mux->cueind, &size);
+
+  if (!write_front_cues (mux, cues, size))
+    {
+      fprintf (stderr, "warning: cues don't fit in the checkpoint anymore, "
+	       "they will only be written at the end\n\n");
+      mux->checkpoint_distance = 0;
+    }
+
+  free (cues);
+}
+
+
+void
+write_matroska_cluster (struct muxer *mux)
+{
+  unsigned char header [12] = {0x1f, 0x43, 0xb6, 0x75};
+  int len = ebml_size_length (mux->cluster.used);
+
+  /* the cluster was built in memory, so it goes out in one piece with
+     its real size; a crash loses at most the cluster in progress */
+
+  store_ebml_size (header+4, mux->cluster.used, len);
+  write_bytes (&mux->ob, header, 4+len);
+  write_bytes (&mux->ob, mux->cluster.buf, mux->cluster.used);
+  mux->cluster.used = 0;
+}
+
+
+void
+write_matroska_frame (struct muxer *mux, unsigned char *payload,
+		      int size, long timestamp, int keyframe, int discardable)
+{
+  unsigned char cluster_header [12] = {0x1f, 0x43, 0xb6, 0x75};
+  int timestamp_within_cluster;
+
+
+  /* every file starts from timestamp zero */
+
+  if (mux->timestamp_offset < 0)
+    mux->timestamp_offset = timestamp;
+
+  timestamp -= mux->timestamp_offset;
+
+  /* a cluster spans a whole GOP, unless block timestamps would overflow
+     their 16 bits first */
+
+  if (mux->cluster_pos < 0 || keyframe
+      || timestamp-mux->timestamp_of_cluster > 0x7fff
+      || timestamp-mux->timestamp_of_cluster < -0x8000)
+    {
+      /*if (!keyframe)
+	fprintf (stderr, "warning: closing a cluster before a new IDR "
+	"was reached\n");*/
+
+      if (mux->cluster_pos >= 0 && !mux->streaming)
+	{
+	  write_matroska_cluster (mux);
+	  flush_output_buffer (&mux->ob);
+
+	  if (mux->checkpoint_distance
+	      && timestamp-mux->last_checkpoint >= mux->checkpoint_distance)
+	    {
+	      write_cue_checkpoint (mux);
+	      mux->last_checkpoint = timestamp;
+	    }
+	}
+
+      mux->timestamp_of_cluster = timestamp;
+      mux->cluster_pos = output_position (&mux->ob);
+
+      /* a live stream can't wait for the cluster to be complete, so its
+	 clusters have unknown size and every block goes out at once */
+
+      if (mux->streaming)
+	{
+	  store_int64_bigend (cluster_header+4, EBML_UNKNOWN_SIZE8);
+	  write_bytes (&mux->ob, cluster_header, sizeof (cluster_header));
+	}
+
+      mem_put_ebml_uint (&mux->cluster, 0xe7, timestamp);  /* timestamp */
+    }
+
+  timestamp_within_cluster = timestamp-mux->timestamp_of_cluster;
+
+  if (keyframe && (mux->last_cue_timestamp < 0
+		   || timestamp-mux->last_cue_timestamp >= mux->cue_distance))
+    {
+      /*fprintf (stderr, "keyframe at %ld, offset is %ld\n", timestamp,
+	mux->cluster_pos-mux->segment_body);*/
+
+      add_cue (&mux->cuevec, &mux->cueind, timestamp,
+	       mux->cluster_pos-mux->segment_body, mux->cluster.used);
+      mux->last_cue_timestamp = timestamp;
+    }
+
+  mem_put_ebml_id (&mux->cluster, 0xa3);  /* simple block */
+  mem_put_ebml_size (&mux->cluster, 4+nal_lengths_size (payload, size));
+  mem_put8 (&mux->cluster, 0x81);  /* track number */
+  mem_put16 (&mux->cluster, timestamp_within_cluster);
+  mem_put8 (&mux->cluster, (keyframe ? 0x80 : 0) | (discardable ? 0x01 : 0));
+  mem_put_nal_lengths (&mux->cluster, payload, size);
+
+  mux->frames_written++;
+
+  if (mux->streaming)
+    {
+      write_bytes (&mux->ob, mux->cluster.buf, mux->cluster.used);
+      mux->cluster.used = 0;
+      flush_output_buffer (&mux->ob);
+    }
+}
+
+
+void
+finish_matroska (struct muxer *mux)
+{
+  struct output_buffer *ob = &mux->ob;
+  struct cue_vector *cuevec, *next;
+  unsigned char *cues, seek [CUES_SEEK_SIZE], voidh [9];
+  size_t cues_size;
+  off_t off;
+
+
+  if (mux->streaming)
+    {
+      finish_output (ob);
+      print_output_stats (ob, mux->frames_written,
+			  get_time ()-mux->start_time);
+      free_output_buffer (ob);
+      free (mux->cluster.buf);
+      return;
+    }
+
+  if (mux->cluster_pos >= 0)
+    write_matroska_cluster (mux);
+
+  free (mux->cluster.buf);
+
+  /* the final cues go in the room reserved after the header if they fit,
+     otherwise at the end and the checkpoint becomes a void again */
+
+  cues = make_cues (&mux->cue_vectors, mux->cueind, &cues_size);
+
+  if (mux->front_cues_pos < 0 || !write_front_cues (mux, cues, cues_size))
+    {
+      if (mux->front_cues_pos >= 0)
+	fprintf (stderr, "cues didn't fit in the room reserved for them, "
+		 "writing them at the end\n");
+
+      if (mux->checkpointed)
+	{
+	  voidh [0] = 0xec;
+	  store_int64_bigend (voidh+1, EBML_SIZE8 (mux->front_cues_size-9));
+	  patch_output (ob, mux->front_cues_pos, voidh, 9);
+	}
+
+      off = output_position (ob);
+      fill_cues_seek (seek, off-mux->segment_body);
+      patch_output (ob, mux->cues_seek_pos, seek, CUES_SEEK_SIZE);
+      write_bytes (ob, cues, cues_size);
+    }
+
+  free (cues);
+
+  off = output_position (ob);
+  patch_int64_bigend (ob, mux->segment_size_pos,
+		      EBML_SIZE8 (off-mux->segment_body));
+
+  finish_output (ob);
+
+  print_output_stats (ob, mux->frames_written, get_time ()-mux->start_time);
+
+  free_output_buffer (ob);
+
+  cuevec = mux->cue_vectors.next;
+
+  while (cuevec)
+    {
+      next = cuevec->next;
+      free (cuevec);
+      cuevec = next;
+    }
+}
+
+
+void
+box_open (struct mem_writer *bw, const char *type)
+{
+  bw->open [bw->depth++] = bw->used;
+  mem_put32 (bw, 0);  /* size, set by box_close */
+  mem_put (bw, type, 4);
+}
+
+
+void
+box_open_full (struct mem_writer *bw, const char *type, int version,
+	       int flags)
+{
+  box_open (bw, type);
+  mem_put32 (bw, (unsigned long)version << 24 | flags);
+}
+
+
+void
+box_close (struct mem_writer *bw)
+{
+  size_t start = bw->open [--bw->depth];
+
+  store_int32_bigend (bw->buf+start, bw->used-start);
+}
+
+
+void
+box_put_matrix (struct mem_writer *bw)  /* the identity */
+{
+  unsigned long m [] = {0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000};
+  int i;
+
+  for (i = 0; i < 9; i++)
+    mem_put32 (bw, m [i]);
+}
+
+
+void
+start_mp4 (struct muxer *mux, char *filename, struct recording_options *opts,
+	   int width, int height, int default_duration,
+	   x264_nal_t headers [], int headers_num)
+{
+  struct mem_writer bw = {0};
+  unsigned long timescale = 1000000000/opts->timestamp_scale;
+  unsigned char zeros [24] = {0}, compressor [32] = "\x09screenrec";
+
+  if (!timescale || 1000000000 % opts->timestamp_scale)
+    {
+      fprintf (stderr, "mp4 output needs a timestamp scale that divides one "
+	       "second\n");
+      exit (1);
+    }
+
+  open_muxer_output (mux, filename, opts);
+
+  /* the moov describes no samples, they all come in the fragments, so
+     the file never needs to be seeked and works on pipes too */
+
+  box_open (&bw, "ftyp");
+  mem_put (&bw, "isom", 4);
+  mem_put32 (&bw, 0x200);
+  mem_put (&bw, "isomiso6avc1mp41", 16);
+  box_close (&bw);
+
+  box_open (&bw, "moov");
+
+  box_open_full (&bw, "mvhd", 0, 0);
+  mem_put32 (&bw, 0);  /* creation time */
+  mem_put32 (&bw, 0);  /* modification time */
+  mem_put32 (&bw, timescale);
+  mem_put32 (&bw, 0);  /* duration, unknown */
+  mem_put32 (&bw, 0x10000);  /* rate */
+  mem_put16 (&bw, 0x100);  /* volume */
+  mem_put16 (&bw, 0);
+  mem_put64 (&bw, 0);
+  box_put_matrix (&bw);
+  mem_put (&bw, zeros, 24);  /* pre-defined */
+  mem_put32 (&bw, 2);  /* next track id */
+  box_close (&bw);
+
+  box_open (&bw, "trak");
+
+  box_open_full (&bw, "tkhd", 0, 3);  /* enabled and in movie */
+  mem_put64 (&bw, 0);  /* creation and modification time */
+  mem_put32 (&bw, 1);  /* track id */
+  mem_put32 (&bw, 0);
+  mem_put32 (&bw, 0);  /* duration */
+  mem_put64 (&bw, 0);
+  mem_put32 (&bw, 0);  /* layer and alternate group */
+  mem_put32 (&bw, 0);  /* volume */
+  box_put_matrix (&bw);
+  mem_put32 (&bw, (unsigned long)width << 16);
+  mem_put32 (&bw, (unsigned long)height << 16);
+  box_close (&bw);
+
+  box_open (&bw, "mdia");
+
+  box_open_full (&bw, "mdhd", 0, 0);
+  mem_put64 (&bw, 0);  /* creation and modification time */
+  mem_put32 (&bw, timescale);
+  mem_put32 (&bw, 0);  /* duration */
+  mem_put16 (&bw, 0x55c4);  /* undetermined language */
+  mem_put16 (&bw, 0);
+  box_close (&bw);
+
+  box_open_full (&bw, "hdlr", 0, 0);
+  mem_put32 (&bw, 0);
+  mem_put (&bw, "vide", 4);
+  mem_put (&bw, zeros, 12);
+  mem_put (&bw, "screenrec", 10);
+  box_close (&bw);
+
+  box_open (&bw, "minf");
+
+  box_open_full (&bw, "vmhd", 0, 1);
+  mem_put64 (&bw, 0);  /* graphics mode and color */
+  box_close (&bw);
+
+  box_open (&bw, "dinf");
+  box_open_full (&bw, "dref", 0, 0);
+  mem_put32 (&bw, 1);
+  box_open_full (&bw, "url ", 0, 1);  /* data is in this file */
+  box_close (&bw);
+  box_close (&bw);
+  box_close (&bw);
+
+  box_open (&bw, "stbl");
+
+  box_open_full (&bw, "stsd", 0, 0);
+  mem_put32 (&bw, 1);
+  box_open (&bw, "avc1");
+  mem_put (&bw, zeros, 6);
+  mem_put16 (&bw, 1);  /* data reference index */
+  mem_put (&bw, zeros, 16);
+  mem_put16 (&bw, width);
+  mem_put16 (&bw, height);
+  mem_put32 (&bw, 0x480000);  /* 72 dpi */
+  mem_put32 (&bw, 0x480000);
+  mem_put32 (&bw, 0);
+  mem_put16 (&bw, 1);  /* frame count */
+  mem_put (&bw, compressor, 32);
+  mem_put16 (&bw, 0x18);  /* depth */
+  mem_put16 (&bw, 0xffff);
+  box_open (&bw, "avcC");
+  mem_put_avc_config (&bw, headers, headers_num);
+  box_close (&bw);
+  box_close (&bw);
+  box_close (&bw);
+
+  box_open_full (&bw, "stts", 0, 0);
+  mem_put32 (&bw, 0);
+  box_close (&bw);
+  box_open_full (&bw, "stsc", 0, 0);
+  mem_put32 (&bw, 0);
+  box_close (&bw);
+  box_open_full (&bw, "stsz", 0, 0);
+  mem_put64 (&bw, 0);
+  box_close (&bw);
+  box_open_full (&bw, "stco", 0, 0);
+  mem_put32 (&bw, 0);
+  box_close (&bw);
+
+  box_close (&bw);  /* stbl */
+  box_close (&bw);  /* minf */
+  box_close (&bw);  /* mdia */
+  box_close (&bw);  /* trak */
+
+  box_open (&bw, "mvex");
+  box_open_full (&bw, "trex", 0, 0);
+  mem_put32 (&bw, 1);  /* track id */
+  mem_put32 (&bw, 1);  /* sample description index */
+  mem_put32 (&bw, 0);  /* default duration, size and flags */
+  mem_put64 (&bw, 0);
+  box_close (&bw);
+  box_close (&bw);
+
+  box_close (&bw);  /* moov */
+
+  write_bytes (&mux->ob, bw.buf, bw.used);
+  free (bw.buf);
+
+  if (mux->streaming)
+    flush_output_buffer (&mux->ob);
+
+  mux->default_duration = (double)default_duration/opts->timestamp_scale+0.5;
+  mux->samples = NULL;
+  mux->samples_num = mux->samples_size = 0;
+  memset (&mux->frag, 0, sizeof (mux->frag));
+  mux->fragments = 0;
+}
+
+
+void
+write_mp4_fragment (struct muxer *mux, long next_dts)
+{
+  struct mem_writer bw = {0};
+  struct mp4_sample *s;
+  size_t data_offset_pos;
+  unsigned char mdat [8];
+  int i;
+
+
+  box_open (&bw, "moof");
+
+  box_open_full (&bw, "mfhd", 0, 0);
+  mem_put32 (&bw, ++mux->fragments);
+  box_close (&bw);
+
+  box_open (&bw, "traf");
+
+  box_open_full (&bw, "tfhd", 0, 0x20000);  /* offsets start at moof */
+  mem_put32 (&bw, 1);
+  box_close (&bw);
+
+  box_open_full (&bw, "tfdt", 1, 0);
+  mem_put64 (&bw, mux->samples [0].dts);
+  box_close (&bw);
+
+  /* every sample has its own duration, size, flags and signed
+     composition offset */
+
+  box_open_full (&bw, "trun", 1, 0xf01);
+  mem_put32 (&bw, mux->samples_num);
+  data_offset_pos = bw.used;
+  mem_put32 (&bw, 0);
+
+  for (i = 0; i < mux->samples_num; i++)
+    {
+      s = &mux->samples [i];
+      mem_put32 (&bw, (i+1 < mux->samples_num ? s [1].dts : next_dts)
+		 -s->dts);
+      mem_put32 (&bw, s->size);
+      mem_put32 (&bw, s->flags);
+      mem_put32 (&bw, s->pts-s->dts);
+    }
+
+  box_close (&bw);
+  box_close (&bw);  /* traf */
+  box_close (&bw);  /* moof */
+
+  /* sample data starts right after the header of mdat */
+
+  store_int32_bigend (bw.buf+data_offset_pos, bw.used+8);
+
+  store_int32_bigend (mdat, 8+mux->frag.used);
+  memcpy (mdat+4, "mdat", 4);
+
+  write_bytes (&mux->ob, bw.buf, bw.used);
+  write_bytes (&mux->ob, mdat, 8);
+  write_bytes (&mux->ob, mux->frag.buf, mux->frag.used);
+  free (bw.buf);
+
+  mux->samples_num = 0;
+  mux->frag.used = 0;
+
+  if (mux->streaming)
+    flush_output_buffer (&mux->ob);
+}
+
+
+void
+write_mp4_frame (struct muxer *mux, unsigned char *payload, int size,
+		 long pts, long dts, int keyframe, int discardable)
+{
+  size_t start;
+
+  if (mux->timestamp_offset < 0)
+    mux->timestamp_offset = dts;
+
+  pts -= mux->timestamp_offset;
+  dts -= mux->timestamp_offset;
+
+  /* a fragment holds a whole GOP */
+
+  if (keyframe && mux->samples_num)
+    write_mp4_fragment (mux, dts);
+
+  if (mux->samples_num == mux->samples_size)
+    {
+      mux->samples_size = mux->samples_size ? mux->samples_size*2 : 256;
+      mux->samples = realloc (mux->samples,
+			      sizeof (*mux->samples)*mux->samples_size);
+    }
+
+  if (!mux->samples)
+    {
+      fprintf (stderr, "could not allocate memory\n");
+      exit (1);
+    }
+
+  start = mux->frag.used;
+  mem_put_nal_lengths (&mux->frag, payload, size);
+
+  mux->samples [mux->samples_num].size = mux->frag.used-start;
+
+  /* sample flags: depends on others, is not depended on, is not sync */
+
+  mux->samples [mux->samples_num].flags = keyframe ? 0x2000000
+    : (discardable ? 0x1810000 : 0x1010000);
+  mux->samples [mux->samples_num].pts = pts;
+  mux->samples [mux->samples_num].dts = dts;
+  mux->samples_num++;
+
+  mux->frames_written++;
+}
+
+
+void
+finish_mp4 (struct muxer *mux)
+{
+  if (mux->samples_num)
+    write_mp4_fragment (mux, mux->samples [mux->samples_num-1].dts
+			+mux->default_duration);
+
+  finish_output (&mux->ob);
+  print_output_stats (&mux->ob, mux->frames_written,
+		      get_time ()-mux->start_time);
+  free_output_buffer (&mux->ob);
+
+  free (mux->samples);
+  free (mux->frag.buf);
+}
+
+
+#define TS_PACKET_SIZE 188
+
+#define TS_PACKETS_PER_DATAGRAM 7  /* 1316 bytes, fits an ethernet mtu */
+
+#define TS_PMT_PID 0x1000
+
+#define TS_VIDEO_PID 0x100
+
+#define TS_DELAY 63000  /* decoding starts 0.7 s after the clock reference */
+
+
+unsigned
+mpeg_crc32 (const unsigned char *buf, int len)
+{
+  unsigned crc = 0xffffffff;
+  int i, j;
+
+  for (i = 0; i < len; i++)
+    {
+      crc ^= (unsigned)buf [i] << 24;
+
+      for (j = 0; j < 8; j++)
+	crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+
+  return crc;
+}
+
+
+unsigned char *
+new_ts_packet (struct muxer *mux, int pid, int payload_start, int cc_index)
+{
+  unsigned char *pkt;
+
+  if (mux->ts_used+TS_PACKET_SIZE > mux->ts_size)
+    {
+      mux->ts_size = mux->ts_size ? mux->ts_size*2
+	: TS_PACKET_SIZE*TS_PACKETS_PER_DATAGRAM*64;
+      mux->ts_data = realloc (mux->ts_data, mux->ts_size);
+
+      if (!mux->ts_data)
+	{
+	  fprintf (stderr, "could not allocate memory\n");
+	  exit (1);
+	}
+    }
+
+  pkt = mux->ts_data+mux->ts_used;
+  mux->ts_used += TS_PACKET_SIZE;
+
+  pkt [0] = 0x47;
+  pkt [1] = (payload_start ? 0x40 : 0) | (pid >> 8);
+  pkt [2] = pid & 0xff;
+  pkt [3] = 0x10 | (mux->continuity [cc_index]++ & 0xf);
+
+  return pkt;
+}
+
+
+void
+write_ts_section (struct muxer *mux, int pid, int cc_index,
+		  unsigned char *section, int len)
+{
+  unsigned char *pkt = new_ts_packet (mux, pid, 1, cc_index);
+  unsigned crc = mpeg_crc32 (section, len);
+
+  /* the section is short enough for a single packet, after the pointer
+     field; the rest is stuffing */
+
+  memset (pkt+4, 0xff, TS_PACKET_SIZE-4);
+  pkt [4] = 0;
+  memcpy (pkt+5, section, len);
+  store_int32_bigend (pkt+5+len, crc);
+}
+
+
+void
+write_ts_tables (struct muxer *mux)
+{
+  unsigned char pat []
+    = {0x00, 0xb0, 13, /* table id and section length */
+       0x00, 0x01, 0xc1, 0x00, 0x00, /* stream id, version, section number */
+       0x00, 0x01, 0xe0 | TS_PMT_PID >> 8, TS_PMT_PID & 0xff}; /* program */
+  unsigned char pmt []
+    = {0x02, 0xb0, 18, /* table id and section length */
+       0x00, 0x01, 0xc1, 0x00, 0x00, /* program, version, section number */
+       0xe0 | TS_VIDEO_PID >> 8, TS_VIDEO_PID & 0xff, /* pcr pid */
+       0xf0, 0x00, /* no program descriptors */
+       0x1b, 0xe0 | TS_VIDEO_PID >> 8, TS_VIDEO_PID & 0xff, 0xf0, 0x00};
+       /* h.264 stream with no descriptors */
+
+  write_ts_section (mux, 0, 0, pat, sizeof (pat));
+  write_ts_section (mux, TS_PMT_PID, 1, pmt, sizeof (pmt));
+}
+
+
+void
+store_pes_timestamp (unsigned char *b, int prefix, long ts)
+{
+  b [0] = prefix << 4 | ((ts >> 29) & 0x0e) | 1;
+  b [1] = (ts >> 22) & 0xff;
+  b [2] = ((ts >> 14) & 0xfe) | 1;
+  b [3] = (ts >> 7) & 0xff;
+  b [4] = ((ts << 1) & 0xfe) | 1;
+}
+
+
+int
+open_socket (char *dest, int type, int opt)
+{
+  struct addrinfo hints = {0}, *res;
+  char *host = strdup (dest), *port;
+  int sock, err;
+
+  /* HOST:PORT, with an ipv6 host in brackets */
+
+  port = host ? strrchr (host, ':') : NULL;
+
+  if (!port)
+    {
+      fprintf (stderr, "option '%c' requires an argument like HOST:PORT\n",
+	       opt);
+      exit (1);
+    }
+
+  *port++ = 0;
+
+  if (*host == '[' && host [strlen (host)-1] == ']')
+    {
+      host [strlen (host)-1] = 0;
+      memmove (host, host+1, strlen (host));
+    }
+
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = type;
+
+  if ((err = getaddrinfo (host, port, &hints, &res)))
+    {
+      fprintf (stderr, "couldn't resolve %s: %s\n", dest, gai_strerror (err));
+      exit (1);
+    }
+
+  sock = socket (res->ai_family, type, 0);
+
+  if (sock < 0 || connect (sock, res->ai_addr, res->ai_addrlen) < 0)
+    {
+      fprintf (stderr, "couldn't connect to %s: ", dest);
+      perror ("");
+      exit (1);
+    }
+
+  freeaddrinfo (res);
+  free (host);
+
+  return sock;
+}
+
+
+void
+send_ts_datagrams (struct muxer *mux, long pts)
+{
+  struct mmsghdr msgs [64];
+  struct iovec iovs [64][2];
+  unsigned char rtp [64][12];
+  size_t off = 0, len;
+  int n, sent, i;
+  double start;
+
+  /* everything produced for a frame goes out in as few sendmmsg calls as
+     possible, right when the frame is encoded, so pacing follows the
+     vblank clock */
+
+  while (off < mux->ts_used)
+    {
+      for (n = 0; n < 64 && off < mux->ts_used; n++)
+	{
+	  len = mux->ts_used-off;
+	  len = len > TS_PACKET_SIZE*TS_PACKETS_PER_DATAGRAM
+	    ? TS_PACKET_SIZE*TS_PACKETS_PER_DATAGRAM : len;
+
+	  memset (&msgs [n], 0, sizeof (msgs [n]));
+	  msgs [n].msg_hdr.msg_iov = iovs [n];
+
+	  if (mux->rtp)
+	    {
+	      rtp [n][0] = 0x80;  /* version 2 */
+	      rtp [n][1] = 33;  /* mpeg-ts payload type */
+	      rtp [n][2] = mux->rtp_seq >> 8;
+	      rtp [n][3] = mux->rtp_seq++ & 0xff;
+	      store_int32_bigend (rtp [n]+4, pts);
+	      store_int32_bigend (rtp [n]+8, mux->rtp_ssrc);
+
+	      iovs [n][0].iov_base = rtp [n];
+	      iovs [n][0].iov_len = 12;
+	      msgs [n].msg_hdr.msg_iovlen = 1;
+	    }
+
+	  iovs [n][msgs [n].msg_hdr.msg_iovlen].iov_base = mux->ts_data+off;
+	  iovs [n][msgs [n].msg_hdr.msg_iovlen++].iov_len = len;
+	  off += len;
+	}
+
+      for (i = 0; i < n; i += sent)
+	{
+	  start = get_time ();
+	  sent = sendmmsg (mux->sock, msgs+i, n-i, 0);
+	  count_syscall (&mux->ob, start);
+
+	  if (sent < 0 && errno == ECONNREFUSED)
+	    {
+	      /* nobody is listening yet, which is fine for a live stream;
+		 this batch is dropped */
+
+	      mux->dropped += n-i;
+	      break;
+	    }
+	  else if (sent < 0 && errno != EINTR)
+	    {
+	      fprintf (stderr, "couldn't send to udp socket: ");
+	      perror ("");
+	      exit (1);
+	    }
+	  else if (sent < 0)
+	    sent = 0;
+
+	  mux->datagrams += sent;
+	}
+    }
+
+  mux->ob.bytes += mux->ts_used;
+  mux->ts_used = 0;
+}
+
+
+void
+set_rtp_identity (struct muxer *mux)
+{
+  unsigned r [2];
+
+  /* rfc 3550 wants a random ssrc and starting sequence, so that streams
+     from different runs don't collide; the clock and pid only stand in
+     when the kernel has no getrandom */
+
+  if (getrandom (r, sizeof (r), GRND_NONBLOCK) != sizeof (r))
+    {
+      srand (time (NULL) ^ getpid () << 16);
+      r [0] = rand ();
+      r [1] = rand ();
+    }
+
+  mux->rtp_seq = r [0];
+  mux->rtp_ssrc = r [1];
+}
+
+
+void
+start_mpegts (struct muxer *mux, char *filename,
+	      struct recording_options *opts, x264_nal_t headers [],
+	      int headers_num)
+{
+  int i;
+
+  if (opts->udp_dest)
+    {
+      /* the output buffer only keeps statistics here */
+
+      memset (&mux->ob, 0, sizeof (mux->ob));
+      mux->ob.fd = -1;
+      mux->format = opts->format;
+      mux->filename = opts->udp_dest;
+      mux->streaming = 1;
+      mux->timestamp_offset = -1;
+      mux->frames_written = 0;
+      mux->start_time = get_time ();
+
+      mux->sock = open_socket (opts->udp_dest, SOCK_DGRAM, 'U');
+      mux->rtp = opts->rtp;
+      set_rtp_identity (mux);
+      mux->datagrams = mux->dropped = 0;
+
+      fprintf (stderr, "sending MPEG-TS%s to %s\n\n",
+	       mux->rtp ? " over RTP" : "", opts->udp_dest);
+    }
+  else
+    {
+      open_muxer_output (mux, filename, opts);
+      mux->sock = -1;
+    }
+
+  mux->timestamp_scale = opts->timestamp_scale;
+  memset (mux->continuity, 0, sizeof (mux->continuity));
+  mux->ts_data = NULL;
+  mux->ts_used = mux->ts_size = 0;
+
+  /* a receiver can join at any keyframe, so each one carries the
+     parameter sets along with the tables */
+
+  mux->parameter_sets = NULL;
+  mux->parameter_sets_size = 0;
+
+  for (i = 0; i < headers_num; i++)
+    {
+      if (headers [i].i_type != NAL_SPS && headers [i].i_type != NAL_PPS)
+	continue;
+
+      mux->parameter_sets = realloc (mux->parameter_sets,
+				     mux->parameter_sets_size
+				     +headers [i].i_payload);
+
+      if (!mux->parameter_sets)
+	{
+	  fprintf (stderr, "could not allocate %d bytes.  Exiting...\n",
+		   mux->parameter_sets_size+headers [i].i_payload);
+	  exit (1);
+	}
+
+      memcpy (mux->parameter_sets+mux->parameter_sets_size,
+	      headers [i].p_payload, headers [i].i_payload);
+      mux->parameter_sets_size += headers [i].i_payload;
+    }
+}
+
+
+void
+write_mpegts_frame (struct muxer *mux, unsigned char *payload, int size,
+		    long pts, long dts, int keyframe)
+{
+  unsigned char pes [19+6], *pkt, *data;
+  const unsigned char *part [3];
+  int part_len [3], pes_len, room, af, first = 1, left, p = 0, n;
+  long pcr;
+
+  if (mux->timestamp_offset < 0)
+    mux->timestamp_offset = dts;
+
+  /* timestamps are in 90 kHz units, the clock reference in 27 MHz */
+
+  pcr = (double)(dts-mux->timestamp_offset)*mux->timestamp_scale*27/1000+0.5;
+  pts = (double)(pts-mux->timestamp_offset)*mux->timestamp_scale*9/100000
+    +0.5+TS_DELAY;
+  dts = (double)(dts-mux->timestamp_offset)*mux->timestamp_scale*9/100000
+    +0.5+TS_DELAY;
+
+  if (keyframe || !mux->frames_written)
+    write_ts_tables (mux);
+
+  memcpy (pes, "\0\0\1\xe0\0\0\x80", 7);  /* video, unbounded length */
+
+  if (pts != dts)
+    {
+      pes [7] = 0xc0;
+      pes [8] = 10;
+      store_pes_timestamp (pes+9, 3, pts);
+      store_pes_timestamp (pes+14, 1, dts);
+      pes_len = 19;
+    }
+  else
+    {
+      pes [7] = 0x80;
+      pes [8] = 5;
+      store_pes_timestamp (pes+9, 2, pts);
+      pes_len = 14;
+    }
+
+  /* every access unit in a transport stream starts with a delimiter */
+
+  memcpy (pes+pes_len, "\0\0\0\1\x09\xf0", 6);
+  pes_len += 6;
+
+  /* the pes header and delimiter, the parameter sets of a keyframe and
+     the frame itself run through the packets one after the other */
+
+  part [0] = pes;
+  part_len [0] = pes_len;
+  part [1] = mux->parameter_sets;
+  part_len [1] = keyframe || !mux->frames_written
+    ? mux->parameter_sets_size : 0;
+  part [2] = payload;
+  part_len [2] = size;
+
+  left = part_len [0]+part_len [1]+part_len [2];
+
+  while (left)
+    {
+      pkt = new_ts_packet (mux, TS_VIDEO_PID, first, 2);
+
+      /* the first packet of a frame carries the clock reference, the
+	 last one is padded with adaptation field stuffing */
+
+      af = first ? 8 : 0;
+      room = TS_PACKET_SIZE-4-af;
+
+      if (left < room)
+	{
+	  af = TS_PACKET_SIZE-4-left;
+	  room = left;
+	}
+
+      data = pkt+4+af;
+
+      if (af)
+	{
+	  pkt [3] |= 0x20;
+	  pkt [4] = af-1;
+
+	  if (af > 1)
+	    {
+	      memset (pkt+5, 0xff, af-1);
+	      pkt [5] = first ? 0x10 | (keyframe ? 0x40 : 0) : 0;
+	    }
+
+	  if (first)
+	    {
+	      pkt [6] = (pcr/300 >> 25) & 0xff;
+	      pkt [7] = (pcr/300 >> 17) & 0xff;
+	      pkt [8] = (pcr/300 >> 9) & 0xff;
+	      pkt [9] = (pcr/300 >> 1) & 0xff;
+	      pkt [10] = (pcr/300 & 1) << 7 | 0x7e | (pcr%300 >> 8);
+	      pkt [11] = pcr%300 & 0xff;
+	    }
+	}
+
+      left -= room;
+
+      while (room)
+	{
+	  while (!part_len [p])
+	    p++;
+
+	  n = room < part_len [p] ? room : part_len [p];
+	  memcpy (data, part [p], n);
+	  data += n;
+	  part [p] += n;
+	  part_len [p] -= n;
+	  room -= n;
+	}
+
+      first = 0;
+    }
+
+  if (mux->sock >= 0)
+    send_ts_datagrams (mux, pcr/300);
+  else
+    {
+      write_bytes (&mux->ob, mux->ts_data, mux->ts_used);
+      mux->ts_used = 0;
+
+      if (mux->streaming)
+	flush_output_buffer (&mux->ob);
+    }
+
+  mux->frames_written++;
+}
+
+
+void
+finish_mpegts (struct muxer *mux)
+{
+  if (mux->sock >= 0)
+    {
+      close (mux->sock);
+      print_output_stats (&mux->ob, mux->frames_written,
+			  get_time ()-mux->start_time);
+      fprintf (stderr, "sent %ld datagrams, %ld dropped while nobody was "
+	       "listening\n", mux->datagrams, mux->dropped);
+    }
+  else
+    {
+      finish_output (&mux->ob);
+      print_output_stats (&mux->ob, mux->frames_written,
+			  get_time ()-mux->start_time);
+      free_output_buffer (&mux->ob);
+    }
+
+  free (mux->ts_data);
+  free (mux->parameter_sets);
+}
+
+
+void
+start_h264 (struct muxer *mux, char *filename, struct recording_options *opts,
+	    x264_nal_t headers [], int headers_num)
+{
+  int i;
+
+  open_muxer_output (mux, filename, opts);
+
+  /* an annex b stream needs no container, just the parameter sets in
+     front so that every file can be decoded on its own */
+
+  for (i = 0; i < headers_num; i++)
+    write_bytes (&mux->ob, headers [i].p_payload, headers [i].i_payload);
+}
+
+
+void
+write_h264_frame (struct muxer *mux, unsigned char *payload, int size)
+{
+  write_bytes (&mux->ob, payload, size);
+  mux->frames_written++;
+
+  if (mux->streaming)
+    flush_output_buffer (&mux->ob);
+}
+
+
+void
+finish_h264 (struct muxer *mux)
+{
+  finish_output (&mux->ob);
+  print_output_stats (&mux->ob, mux->frames_written,
+		      get_time ()-mux->start_time);
+  free_output_buffer (&mux->ob);
+}
+
+
+void
+start_muxer (struct muxer *mux, char *filename, struct recording_options *opts,
+	     int width, int height, int default_duration,
+	     x264_nal_t headers [], int headers_num)
+{
+  if (opts->format == FORMAT_MP4)
+    start_mp4 (mux, filename, opts, width, height, default_duration, headers,
+	       headers_num);
+  else if (opts->format == FORMAT_MPEGTS)
+    start_mpegts (mux, filename, opts, headers, headers_num);
+  else if (opts->format == FORMAT_H264)
+    start_h264 (mux, filename, opts, headers, headers_num);
+  else
+    start_matroska (mux, filename, opts, width, height, default_duration,
+		    headers, headers_num);
+}
+
+
+void
+write_frame (struct muxer *mux, unsigned char *payload, int size, long pts,
+	     long dts, int keyframe, int discardable)
+{
+  if (mux->format == FORMAT_MP4)
+    write_mp4_frame (mux, payload, size, pts, dts, keyframe, discardable);
+  else if (mux->format == FORMAT_MPEGTS)
+    write_mpegts_frame (mux, payload, size, pts, dts, keyframe);
+  else if (mux->format == FORMAT_H264)
+    write_h264_frame (mux, payload, size);
+  else
+    write_matroska_frame (mux, payload, size, pts, keyframe, discardable);
+}
+
+
+void
+finish_muxer (struct muxer *mux)
+{
+  if (mux->format == FORMAT_MP4)
+    finish_mp4 (mux);
+  else if (mux->format == FORMAT_MPEGTS)
+    finish_mpegts (mux);
+  else if (mux->format == FORMAT_H264)
+    finish_h264 (mux);
+  else
+    finish_matroska (mux);
+}
+
+
+struct
+replay_frame  /* an encoded frame kept in memory */
+{
+  unsigned char *payload;
+  int size;
+  long timestamp, dts;
+  int keyframe, discardable;
+
+  int refs;  /* the ring and every dump in progress hold one */
+  struct replay_frame *next;
+};
+
+
+#define REPLAY_DEFAULT_SIZE (1024L << 20)
+
+
+struct
+replay_buffer
+{
+  struct replay_frame *first, *last;
+  long duration;  /* in timestamp ticks */
+  size_t bytes, max_bytes;  /* bytes counts frames pinned by dumps too */
+
+  int dumps_num;
+  pthread_mutex_t lock;
+  pthread_cond_t dump_finished;  /* protected by lock, with dumps_running */
+  int dumps_running;
+};
+
+
+struct
+replay_dump
+{
+  struct replay_buffer *replay;
+  struct replay_frame *first, *last;
+  char *filename;
+
+  struct recording_options *opts;
+  int width, height, default_duration, headers_num;
+  x264_nal_t *headers;
+};
+
+
+volatile sig_atomic_t replay_dump_requested;
+
+
+void
+request_replay_dump (int sig)
+{
+  replay_dump_requested = 1;
+}
+
+
+void
+release_replay_frame (struct replay_buffer *replay, struct replay_frame *fr)
+{
+  if (__atomic_sub_fetch (&fr->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  __atomic_sub_fetch (&replay->bytes, fr->size, __ATOMIC_RELAXED);
+  free (fr->payload);
+  free (fr);
+}
+
+
+void
+append_replay_frame (struct replay_buffer *replay, unsigned char *payload,
+		     int size, long timestamp, long dts, int keyframe,
+		     int discardable)
+{
+  struct replay_frame *fr = malloc_and_check (sizeof (*fr)), *k;
+
+  fr->payload = malloc_and_check (size);
+  memcpy (fr->payload, payload, size);
+  fr->size = size;
+  fr->timestamp = timestamp;
+  fr->dts = dts;
+  fr->keyframe = keyframe;
+  fr->discardable = discardable;
+  fr->refs = 1;
+  fr->next = NULL;
+
+  if (replay->last)
+    replay->last->next = fr;
+  else
+    replay->first = fr;
+
+  replay->last = fr;
+  __atomic_add_fetch (&replay->bytes, size, __ATOMIC_RELAXED);
+
+  /* drop whole GOPs from the front, as long as the keyframe starting the
+     next one is still old enough to cover the requested duration, or the
+     frames take more memory than allowed; this way the ring always starts
+     with a keyframe */
+
+  for (;;)
+    {
+      for (k = replay->first->next; k && !k->keyframe; k = k->next)
+	;
+
+      if (!k || (timestamp-k->timestamp < replay->duration
+		 && __atomic_load_n (&replay->bytes, __ATOMIC_RELAXED)
+		 <= replay->max_bytes))
+	break;
+
+      while (replay->first != k)
+	{
+	  fr = replay->first;
+	  replay->first = fr->next;
+	  release_replay_frame (replay, fr);
+	}
+    }
+}
+
+
+void *
+write_replay_dump (void *arg)
+{
+  struct replay_dump *dump = arg;
+  struct muxer mux;
+  struct replay_frame *fr = dump->first, *next;
+  int done = 0;
+
+  start_muxer (&mux, dump->filename, dump->opts, dump->width, dump->height,
+	       dump->default_duration, dump->headers, dump->headers_num);
+
+  while (!done)
+    {
+      write_frame (&mux, fr->payload, fr->size, fr->timestamp, fr->dts,
+		   fr->keyframe, fr->discardable);
+
+      /* the recording thread may be appending after the last frame, so
+	 its next pointer isn't ours to read */
+
+      done = fr == dump->last;
+      next = done ? NULL : fr->next;
+      release_replay_frame (dump->replay, fr);
+      fr = next;
+    }
+
+  finish_muxer (&mux);
+
+  fprintf (stderr, "saved %s\n", dump->filename);
+
+  pthread_mutex_lock (&dump->replay->lock);
+  dump->replay->dumps_running--;
+  pthread_cond_signal (&dump->replay->dump_finished);
+  pthread_mutex_unlock (&dump->replay->lock);
+
+  free (dump->filename);
+  free (dump);
+
+  return NULL;
+}
+
+
+void
+dump_replay_buffer (struct replay_buffer *replay,
+		    struct recording_options *opts, int width, int height,
+		    int default_duration, x264_nal_t headers [],
+		    int headers_num)
+{
+  struct replay_dump *dump;
+  struct replay_frame *fr;
+  pthread_t thread;
+
+  if (!replay->first)
+    {
+      fprintf (stderr, "nothing to save yet\n");
+      return;
+    }
+
+  dump = malloc_and_check (sizeof (*dump));
+  dump->replay = replay;
+  dump->first = replay->first;
+  dump->last = replay->last;
+  dump->filename = make_segment_filename (opts->output, ++replay->dumps_num);
+  dump->opts = opts;
+  dump->width = width;
+  dump->height = height;
+  dump->default_duration = default_duration;
+  dump->headers = headers;
+  dump->headers_num = headers_num;
+
+  /* the frames are pinned so that the ring can move on while the file
+     is written from another thread */
+
+  for (fr = dump->first; ; fr = fr->next)
+    {
+      __atomic_add_fetch (&fr->refs, 1, __ATOMIC_RELAXED);
+
+      if (fr == dump->last)
+	break;
+    }
+
+  pthread_mutex_lock (&replay->lock);
+  replay->dumps_running++;
+  pthread_mutex_unlock (&replay->lock);
+
+  if (pthread_create (&thread, NULL, write_replay_dump, dump))
+    {
+      fprintf (stderr, "couldn't create thread\n");
+      exit (1);
+    }
+
+  pthread_detach (thread);
+}
+
+
+void
+wait_for_replay_dumps (struct replay_buffer *replay)
+{
+  pthread_mutex_lock (&replay->lock);
+
+  while (replay->dumps_running)
+    pthread_cond_wait (&replay->dump_finished, &replay->lock);
+
+  pthread_mutex_unlock (&replay->lock);
+}
+
+
+#define FRAME_RING_MAGIC 0x52465253  /* "SRFR" */
+
+#define FRAME_RING_RGB24 0x33424752  /* "RGB3", bytes in r, g, b order */
+
+#define FRAME_RING_MAX_RECTS 32
+
+#define FRAME_RING_PAGE 4096
+
+
+/* the shared memory seen by local consumers, who run on the same machine
+   and so agree on the sizes and byte order of these fields */
+
+struct
+frame_ring_rect
+{
+  unsigned int x, y, w, h;
+};
+
+
+struct
+frame_slot
+{
+  unsigned int sequence;  /* 2n+1 while frame n is written, 2n+2 after */
+  unsigned int rects_num;  /* areas changed since the previous frame */
+  long long timestamp;  /* in nanoseconds from the first frame */
+  struct frame_ring_rect rects [FRAME_RING_MAX_RECTS];
+};  /* the pixels follow from the next page */
+
+
+struct
+frame_ring_header
+{
+  unsigned int magic, slots_num, slot_size, format, width, height, stride;
+  unsigned int frame_duration;  /* in nanoseconds */
+  unsigned int published;  /* number of complete frames, a futex */
+  unsigned int waiters;  /* consumers sleeping on the futex */
+
+  /* a lossless ring belongs to a capture daemon and a single encoder: a
+     slot is reused only after the encoder has consumed its frame */
+  unsigned int lossless;
+  unsigned int consumed;  /* a futex too */
+  unsigned int producer_waiting;
+  unsigned int closed;  /* the capture daemon has stopped */
+};
+
+
+struct
+frame_ring
+{
+  unsigned char *map;
+  struct frame_ring_header *header;
+  unsigned int frames;
+  unsigned char *prev;
+};
+
+
+void
+map_frame_ring (struct frame_ring *ring, int fd, size_t size)
+{
+  ring->map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (ring->map == MAP_FAILED)
+    {
+      fprintf (stderr, "couldn't map shared memory for frames: ");
+      perror ("");
+      exit (1);
+    }
+
+  ring->header = (struct frame_ring_header *)ring->map;
+  ring->frames = 0;
+  ring->prev = NULL;
+}
+
+
+void
+open_frame_ring (struct frame_ring *ring, int slots, int w, int h,
+		 int frame_duration, char *path, int lossless)
+{
+  size_t slot_size = (FRAME_RING_PAGE+(size_t)w*h*3+FRAME_RING_PAGE-1)
+    & ~(size_t)(FRAME_RING_PAGE-1), size = FRAME_RING_PAGE+slots*slot_size;
+  char *uid = getenv ("SUDO_UID"), *gid = getenv ("SUDO_GID");
+  int fd;
+
+  /* a capture daemon shares a file, usually in /dev/shm, and so does a
+     ring published with -P; when started through sudo, the file is given
+     to the user so that the encoder or viewer doesn't need root too */
+
+  if (path)
+    {
+      /* an old file is replaced, not reused: in a shared directory it may
+	 have been put there by another user, or be a link to elsewhere */
+
+      if (unlink (path) < 0 && errno != ENOENT)
+	{
+	  fprintf (stderr, "couldn't remove the old %s: ", path);
+	  perror ("");
+	  exit (1);
+	}
+
+      fd = open (path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+
+      if (fd >= 0 && uid && gid && fchown (fd, atoi (uid), atoi (gid)) < 0)
+	fprintf (stderr, "warning: couldn't give %s to the sudo user\n",
+		 path);
+    }
+  else
+    fd = memfd_create ("screenrec-frames", 0);
+
+  if (fd < 0 || ftruncate (fd, size) < 0)
+    {
+      fprintf (stderr, "couldn't create shared memory for frames: ");
+      perror ("");
+      exit (1);
+    }
+
+  map_frame_ring (ring, fd, size);
+
+  ring->header->slots_num = slots;
+  ring->header->slot_size = slot_size;
+  ring->header->format = FRAME_RING_RGB24;
+  ring->header->width = w;
+  ring->header->height = h;
+  ring->header->stride = w*3;
+  ring->header->frame_duration = frame_duration;
+  ring->header->lossless = lossless;
+  __atomic_store_n (&ring->header->magic, FRAME_RING_MAGIC, __ATOMIC_RELEASE);
+
+  if (path)
+    {
+      close (fd);
+      fprintf (stderr, "%s frames %s %s, %d slots of %ld bytes\n\n",
+	       lossless ? "capturing" : "publishing",
+	       lossless ? "into" : "in", path, slots, (long)slot_size);
+    }
+  else
+    {
+      /* the fd stays open for the whole recording, so consumers can open
+	 the memory through proc; only the same user can do that, though */
+
+      fprintf (stderr, "publishing frames in /proc/%d/fd/%d, %d slots of "
+	       "%ld bytes\n\n", (int)getpid (), fd, slots, (long)slot_size);
+
+      if (!geteuid ())
+	fprintf (stderr, "warning: other users can't open that path of a "
+		 "root process, use -P to publish in a file\n\n");
+    }
+}
+
+
+void
+attach_frame_ring (struct frame_ring *ring, char *path)
+{
+  struct frame_ring_header header;
+  struct stat st;
+  int fd = open (path, O_RDWR);
+
+  if (fd < 0 || fstat (fd, &st) < 0)
+    {
+      fprintf (stderr, "couldn't open %s: ", path);
+      perror ("");
+      exit (1);
+    }
+
+  if (st.st_size < FRAME_RING_PAGE
+      || pread (fd, &header, sizeof (header), 0) != sizeof (header)
+      || header.magic != FRAME_RING_MAGIC || !header.lossless
+      || header.format != FRAME_RING_RGB24
+      || st.st_size < FRAME_RING_PAGE
+      +(off_t)header.slots_num*header.slot_size)
+    {
+      fprintf (stderr, "%s is not a frame ring of a screenrec capture "
+	       "daemon\n", path);
+      exit (1);
+    }
+
+  map_frame_ring (ring, fd, st.st_size);
+  close (fd);
+}
+
+
+void
+wait_on_futex (unsigned int *futex, unsigned int value, unsigned int *waiting)
+{
+  struct timespec timeout = {0, 100000000};
+
+  /* the timeout lets the caller look at its standard input and at the
+     other side, which may have gone away */
+
+  __atomic_add_fetch (waiting, 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n (futex, __ATOMIC_SEQ_CST) == value)
+    syscall (SYS_futex, futex, FUTEX_WAIT, value, &timeout, NULL, 0);
+
+  __atomic_sub_fetch (waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+
+void
+wake_futex (unsigned int *futex, unsigned int *waiting)
+{
+  /* waking costs a system call, so only when someone is sleeping */
+
+  if (__atomic_load_n (waiting, __ATOMIC_SEQ_CST))
+    syscall (SYS_futex, futex, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+}
+
+
+struct frame_slot *
+ring_slot (struct frame_ring *ring, unsigned int frame)
+{
+  return (struct frame_slot *)(ring->map+FRAME_RING_PAGE
+			       +(frame%ring->header->slots_num)
+			       *ring->header->slot_size);
+}
+
+
+unsigned char *
+begin_ring_frame (struct frame_ring *ring, struct thread_args *args,
+		  int nthreads)
+{
+  struct frame_slot *slot = ring_slot (ring, ring->frames);
+  unsigned char *pixels = (unsigned char *)slot+FRAME_RING_PAGE;
+  int i;
+
+  /* consumers reading this slot will see the odd sequence and know that
+     it's being overwritten; a release fence would only order the stores
+     before it, so a full one keeps the pixels from overtaking the odd
+     sequence, as smp_wmb does in the kernel's seqlocks */
+
+  __atomic_store_n (&slot->sequence, 2*ring->frames+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+  /* an encoder has no use for dirty rects, so a lossless ring doesn't
+     spend time comparing frames */
+
+  for (i = 0; i < nthreads; i++)
+    {
+      args [i].out = pixels;
+      args [i].prev = ring->header->lossless ? NULL : ring->prev;
+    }
+
+  ring->prev = pixels;
+  return pixels;
+}
+
+
+void
+publish_ring_frame (struct frame_ring *ring, struct thread_args *args,
+		    int nthreads, long long timestamp)
+{
+  struct frame_slot *slot = ring_slot (ring, ring->frames);
+  struct frame_ring_rect *r;
+  int i, n = 0, group, last_group = -1;
+
+  /* each detiling thread reports the changed area of its strip; with
+     more threads than rects, neighbouring strips share a rect */
+
+  for (i = 0; i < nthreads; i++)
+    {
+      if (!args [i].prev)
+	{
+	  slot->rects [0].x = slot->rects [0].y = 0;
+	  slot->rects [0].w = args [i].w;
+	  slot->rects [0].h = args [i].h;
+	  n = 1;
+	  break;
+	}
+
+      if (args [i].dirty_x1 == args [i].dirty_x0)
+	continue;
+
+      group = i*FRAME_RING_MAX_RECTS/nthreads;
+      r = &slot->rects [group == last_group ? n-1 : n++];
+
+      if (group != last_group)
+	{
+	  r->x = args [i].dirty_x0;
+	  r->y = args [i].dirty_y0;
+	  r->w = args [i].dirty_x1-args [i].dirty_x0;
+	  r->h = args [i].dirty_y1-args [i].dirty_y0;
+	  last_group = group;
+	}
+      else
+	{
+	  if (args [i].dirty_x0 < r->x)
+	    {
+	      r->w += r->x-args [i].dirty_x0;
+	      r->x = args [i].dirty_x0;
+	    }
+
+	  if (args [i].dirty_x1 > r->x+r->w)
+	    r->w = args [i].dirty_x1-r->x;
+
+	  r->h = args [i].dirty_y1-r->y;
+	}
+    }
+
+  slot->rects_num = n;
+  slot->timestamp = timestamp;
+  __atomic_store_n (&slot->sequence, 2*ring->frames+2, __ATOMIC_RELEASE);
+
+  ring->frames++;
+  __atomic_store_n (&ring->header->published, ring->frames, __ATOMIC_SEQ_CST);
+  wake_futex (&ring->header->published, &ring->header->waiters);
+}
+
+
+int
+wait_for_ring_room (struct frame_ring *ring)
+{
+  unsigned int consumed = __atomic_load_n (&ring->header->consumed,
+					   __ATOMIC_ACQUIRE);
+
+  if (ring->frames-consumed < ring->header->slots_num)
+    return 1;
+
+  wait_on_futex (&ring->header->consumed, consumed,
+		 &ring->header->producer_waiting);
+
+  return ring->frames-__atomic_load_n (&ring->header->consumed,
+				       __ATOMIC_ACQUIRE)
+    < ring->header->slots_num;
+}
+
+
+void
+close_frame_ring (struct frame_ring *ring)
+{
+  __atomic_store_n (&ring->header->closed, 1, __ATOMIC_SEQ_CST);
+  syscall (SYS_futex, &ring->header->published, FUTEX_WAKE, 0x7fffffff,
+	   NULL, NULL, 0);
+}
+
+
+int
+wait_for_ring_frame (struct frame_ring *ring, unsigned int frame)
+{
+  if (__atomic_load_n (&ring->header->published, __ATOMIC_ACQUIRE) != frame)
+    return 1;
+
+  wait_on_futex (&ring->header->published, frame, &ring->header->waiters);
+
+  return __atomic_load_n (&ring->header->published, __ATOMIC_ACQUIRE)
+    != frame;
+}
+
+
+void
+release_ring_frame (struct frame_ring *ring, unsigned int consumed)
+{
+  __atomic_store_n (&ring->header->consumed, consumed, __ATOMIC_SEQ_CST);
+  wake_futex (&ring->header->consumed, &ring->header->producer_waiting);
+}
+
+
+x264_nal_t *
+copy_nals (x264_nal_t *nals, int num)
+{
+  x264_nal_t *ret = malloc_and_check (sizeof (*ret) * num);
+  int i;
+
+  for (i = 0; i < num; i++)
+    {
+      ret [i] = nals [i];
+      ret [i].p_payload = malloc_and_check (nals [i].i_payload);
+      memcpy (ret [i].p_payload, nals [i].p_payload, nals [i].i_payload);
+    }
+
+  return ret;
+}
+
+
+struct
+encoding
+{
+  struct recording_options *opts;
+  x264_t *enc;
+  x264_picture_t inframe, outframe;
+  x264_nal_t *headers;
+  unsigned char *plane;  /* allocated by x264, we encode from elsewhere */
+  int headers_num, w, h, frame_duration, segmenting, segment_num;
+  long segment_start;
+  char *filename;
+  struct muxer mux;
+  struct replay_buffer replay;
+};
+
+
+#define REMOTE_MAGIC 0x53525246  /* "SRRF" */
+
+#define REMOTE_STREAM_HEADER_SIZE 24
+
+#define REMOTE_FRAME_HEADER_SIZE 16
+
+
+/* the capture client sends a stream header with magic, width, height,
+   frame duration in nanoseconds, recording interval and number of strips,
+   then for each frame the group of pictures it belongs to, its pts in
+   vblanks, the number of strips and the packed size of each, followed by
+   the strips; all numbers are big endian */
+
+struct
+remote_capture
+{
+  int *socks, socks_num, strips, gop_frames, frames_in_gop, current;
+  unsigned int gop;
+  struct thread_args *args;
+  struct strip_delta *deltas;
+  unsigned char *frames [2];
+  struct iovec *iov;
+  unsigned char *header;
+  long bytes_raw, bytes_sent;
+};
+
+
+void
+send_iovecs (int sock, struct iovec *iov, int num)
+{
+  ssize_t ret;
+
+  while (num)
+    {
+      ret = writev (sock, iov, num < IOV_MAX ? num : IOV_MAX);
+
+      if (ret < 0 && errno == EINTR)
+	continue;
+
+      if (ret < 0)
+	{
+	  fprintf (stderr, "couldn't send frame to encode worker: ");
+	  perror ("");
+	  exit (1);
+	}
+
+      while (num && ret >= iov->iov_len)
+	{
+	  ret -= iov->iov_len;
+	  iov++;
+	  num--;
+	}
+
+      if (num)
+	{
+	  iov->iov_base = (char *)iov->iov_base+ret;
+	  iov->iov_len -= ret;
+	}
+    }
+}
+
+
+void
+start_remote_capture (struct remote_capture *rc,
+		      struct recording_options *opts, int w, int h,
+		      int frame_duration, struct thread_args *args,
+		      int nthreads)
+{
+  int i, tiles = (w+TILE_WIDTH-1)/TILE_WIDTH,
+    striph = ceil ((double)h/nthreads);
+  unsigned char header [REMOTE_STREAM_HEADER_SIZE];
+  char *list = strdup (opts->send_to), *dest, *save;
+  struct iovec iov;
+
+
+  rc->socks = malloc_and_check (sizeof (int) * (strlen (list)/2+1));
+  rc->socks_num = 0;
+
+  for (dest = strtok_r (list, ",", &save); dest;
+       dest = strtok_r (NULL, ",", &save))
+    rc->socks [rc->socks_num++] = open_socket (dest, SOCK_STREAM, 'W');
+
+  free (list);
+
+  store_int32_bigend (header, REMOTE_MAGIC);
+  store_int32_bigend (header+4, w);
+  store_int32_bigend (header+8, h);
+  store_int32_bigend (header+12, frame_duration);
+  store_int32_bigend (header+16, opts->recording_interval);
+  store_int32_bigend (header+20, nthreads);
+
+  for (i = 0; i < rc->socks_num; i++)
+    {
+      iov.iov_base = header;
+      iov.iov_len = sizeof (header);
+      send_iovecs (rc->socks [i], &iov, 1);
+    }
+
+  /* each worker gets whole groups of pictures, so that it can encode
+     them on its own, and the workers take turns */
+
+  rc->gop_frames = (double)(opts->gop_time ? opts->gop_time : 2)
+    *1000000000/frame_duration/opts->recording_interval+0.5;
+
+  if (rc->gop_frames < 1)
+    rc->gop_frames = 1;
+
+  rc->gop = 0;
+  rc->frames_in_gop = 0;
+  rc->current = 0;
+  rc->strips = nthreads;
+  rc->args = args;
+  rc->frames [0] = malloc_and_check (w*h*3);
+  rc->frames [1] = malloc_and_check (w*h*3);
+  rc->deltas = malloc_and_check (sizeof (*rc->deltas) * nthreads);
+  rc->iov = malloc_and_check (sizeof (*rc->iov) * (nthreads+1));
+  rc->header = malloc_and_check (REMOTE_FRAME_HEADER_SIZE+4*nthreads);
+  rc->bytes_raw = rc->bytes_sent = 0;
+
+  for (i = 0; i < nthreads; i++)
+    {
+      rc->deltas [i].raw = malloc_and_check (tiles+(size_t)striph*w*3);
+      rc->deltas [i].packed_size = compressBound (tiles+(size_t)striph*w*3);
+      rc->deltas [i].packed = malloc_and_check (rc->deltas [i].packed_size);
+      args [i].delta = &rc->deltas [i];
+    }
+
+  fprintf (stderr, "sending frames to %d encode workers, %d frames each in "
+	   "turn\n\n", rc->socks_num, rc->gop_frames);
+}
+
+
+unsigned char *
+begin_remote_frame (struct remote_capture *rc, struct thread_args *args)
+{
+  unsigned char *out = rc->frames [rc->current],
+    *prev = rc->frames [!rc->current];
+  int i;
+
+  /* the first frame of a group goes whole to a new worker, the others
+     only carry what changed */
+
+  for (i = 0; i < rc->strips; i++)
+    {
+      args [i].out = out;
+      rc->deltas [i].prev = rc->frames_in_gop ? prev : NULL;
+    }
+
+  return out;
+}
+
+
+void
+send_remote_frame (struct remote_capture *rc, long pts)
+{
+  int i, n = 1;
+
+  store_int32_bigend (rc->header, rc->gop);
+  store_int64_bigend (rc->header+4, pts);
+  store_int32_bigend (rc->header+12, rc->strips);
+
+  rc->iov [0].iov_base = rc->header;
+  rc->iov [0].iov_len = REMOTE_FRAME_HEADER_SIZE+4*rc->strips;
+
+  for (i = 0; i < rc->strips; i++)
+    {
+      store_int32_bigend (rc->header+REMOTE_FRAME_HEADER_SIZE+4*i,
+			  rc->deltas [i].packed_len);
+
+      if (rc->deltas [i].packed_len)
+	{
+	  rc->iov [n].iov_base = rc->deltas [i].packed;
+	  rc->iov [n++].iov_len = rc->deltas [i].packed_len;
+	  rc->bytes_sent += rc->deltas [i].packed_len;
+	}
+    }
+
+  rc->bytes_raw += (long)rc->args [0].w*rc->args [0].h*3;
+  rc->bytes_sent += rc->iov [0].iov_len;
+
+  send_iovecs (rc->socks [rc->gop%rc->socks_num], rc->iov, n);
+
+  rc->current = !rc->current;
+
+  if (++rc->frames_in_gop == rc->gop_frames)
+    {
+      rc->gop++;
+      rc->frames_in_gop = 0;
+    }
+}
+
+
+void
+finish_remote_capture_and_exit (struct remote_capture *rc)
+{
+  int i;
+
+  for (i = 0; i < rc->socks_num; i++)
+    close (rc->socks [i]);
+
+  fprintf (stderr, "sent %ld bytes for %ld bytes of frames (%.1f%%)\n",
+	   rc->bytes_sent, rc->bytes_raw,
+	   rc->bytes_raw ? 100.0*rc->bytes_sent/rc->bytes_raw : 0.0);
+
+  exit (0);
+}
+
+
+#define RAW_BUFFERS 4
+
+
+struct
+raw_output
+{
+  int fd, splicing, current;
+  size_t frame_size;
+  unsigned char *buffers [RAW_BUFFERS];
+  long long ends [RAW_BUFFERS];  /* bytes written up to each buffer */
+  long long written;
+  long frames, drain_waits;
+  double start_time;
+};
+
+
+void
+start_raw_output (struct raw_output *ro, struct recording_options *opts,
+		  int w, int h)
+{
+  size_t aligned;
+  struct stat st;
+  int i;
+
+  if (opts->segment_time || opts->segment_size || opts->replay_time
+      || opts->udp_dest)
+    {
+      fprintf (stderr, "raw frames can't be split, replayed or sent over "
+	       "udp\n");
+      exit (1);
+    }
+
+  ro->fd = open_output_file (opts->output, 0);
+  ro->frame_size = (size_t)w*h*3;
+  aligned = (ro->frame_size+4095) & ~(size_t)4095;
+
+  /* a pipe takes the pages of our buffers as they are, instead of a copy
+     of them; it must have room for a whole frame or vmsplice would wait
+     for the consumer at every frame */
+
+  ro->splicing = !fstat (ro->fd, &st) && S_ISFIFO (st.st_mode);
+
+  if (ro->splicing && fcntl (ro->fd, F_SETPIPE_SZ, aligned) < 0)
+    fprintf (stderr, "warning: couldn't make the pipe as big as a frame, "
+	     "output will be slower\n\n");
+
+  for (i = 0; i < RAW_BUFFERS; i++)
+    {
+      ro->buffers [i] = aligned_alloc (4096, aligned);
+
+      if (!ro->buffers [i])
+	{
+	  fprintf (stderr, "could not allocate %lu bytes.  Exiting...\n",
+		   aligned);
+	  exit (1);
+	}
+
+      ro->ends [i] = 0;
+    }
+
+  ro->current = 0;
+  ro->written = 0;
+  ro->frames = ro->drain_waits = 0;
+  ro->start_time = get_time ();
+
+  fprintf (stderr, "writing raw %dx%d frames of packed 24-bit RGB%s\n\n", w,
+	   h, ro->splicing ? " by splicing them into the pipe" : "");
+}
+
+
+unsigned char *
+begin_raw_frame (struct raw_output *ro, struct thread_args *args,
+		 int nthreads)
+{
+  int i, unread;
+
+  /* the pipe may still point to the pages of this buffer; we can detile
+     into it only after the consumer has read past its end */
+
+  while (ro->splicing)
+    {
+      if (ioctl (ro->fd, FIONREAD, &unread) < 0)
+	{
+	  fprintf (stderr, "couldn't query the output pipe: ");
+	  perror ("");
+	  exit (1);
+	}
+
+      if (ro->written-unread >= ro->ends [ro->current])
+	break;
+
+      ro->drain_waits++;
+      usleep (200);
+    }
+
+  for (i = 0; i < nthreads; i++)
+    args [i].out = ro->buffers [ro->current];
+
+  return ro->buffers [ro->current];
+}
+
+
+void
+write_raw_frame (struct raw_output *ro)
+{
+  struct iovec iov = {ro->buffers [ro->current], ro->frame_size};
+  ssize_t ret;
+
+  while (iov.iov_len)
+    {
+      ret = ro->splicing ? vmsplice (ro->fd, &iov, 1, 0)
+	: write (ro->fd, iov.iov_base, iov.iov_len);
+
+      if (ret < 0 && errno == EINTR)
+	continue;
+
+      if (ret < 0)
+	{
+	  fprintf (stderr, "couldn't write raw frame: ");
+	  perror ("");
+	  exit (1);
+	}
+
+      iov.iov_base = (char *)iov.iov_base+ret;
+      iov.iov_len -= ret;
+    }
+
+  ro->written += ro->frame_size;
+  ro->ends [ro->current] = ro->written;
+  ro->current = (ro->current+1)%RAW_BUFFERS;
+  ro->frames++;
+}
+
+
+void
+finish_raw_output_and_exit (struct raw_output *ro)
+{
+  double secs = get_time ()-ro->start_time;
+
+  fprintf (stderr, "wrote %ld frames, %lld bytes at %.1f MB/s, waited %ld "
+	   "times for the consumer\n", ro->frames, ro->written,
+	   secs > 0 ? ro->written/secs/1000000 : 0.0, ro->drain_waits);
+
+  exit (0);
+}
+
+
+void
+check_output_options (struct recording_options *opts)
+{
+  int segmenting = opts->segment_time || opts->segment_size;
+
+  if (opts->format == FORMAT_RAW)
+    {
+      fprintf (stderr, "raw frames can only come straight from the "
+	       "capture\n");
+      exit (1);
+    }
+
+  if (segmenting && (!opts->output || !strcmp (opts->output, "-")))
+    {
+      fprintf (stderr, "splitting the recording in segments requires an "
+	       "output file\n");
+      exit (1);
+    }
+
+  if ((segmenting || opts->replay_time) && opts->udp_dest)
+    {
+      fprintf (stderr, "a live udp output can't be split or replayed\n");
+      exit (1);
+    }
+
+  if (opts->replay_time && (!opts->output || !strcmp (opts->output, "-")))
+    {
+      fprintf (stderr, "the replay buffer requires an output file to name "
+	       "the saved recordings after\n");
+      exit (1);
+    }
+}
+
+
+void
+start_encoding (struct encoding *e, struct recording_options *opts, int w,
+		int h, int frame_duration)
+{
+  x264_param_t par;
+  struct sigaction sa;
+
+
+  e->opts = opts;
+  e->w = w;
+  e->h = h;
+  e->frame_duration = frame_duration;
+  e->segmenting = opts->segment_time || opts->segment_size;
+  e->segment_num = 1;
+  e->segment_start = 0;
+  e->filename = NULL;
+
+  if (x264_param_default_preset (&par, opts->preset, NULL) < 0)
+    {
+      fprintf (stderr, "couldn't configure x264 encoder\n");
+      exit (1);
+    }
+
+  par.i_bitdepth = 8;
+  /*par.i_csp = X264_CSP_I420;*/
+  par.i_csp = X264_CSP_RGB;
+  par.i_width = w;
+  par.i_height = h;
+  par.b_vfr_input = 0;
+  par.b_repeat_headers = 0;
+  par.b_annexb = 1;
+
+  if (x264_param_apply_profile (&par, "high444") < 0)
+    {
+      fprintf (stderr, "couldn't configure x264 encoder\n");
+      exit (1);
+    }
+
+  if (x264_picture_alloc (&e->inframe, X264_CSP_RGB, w, h) < 0)
+    {
+      fprintf (stderr, "couldn't configure x264 encoder\n");
+      exit (1);
+    }
+
+  e->plane = e->inframe.img.plane [0];
+
+  e->enc = x264_encoder_open (&par);
+
+  if (!e->enc)
+    {
+      fprintf (stderr, "couldn't configure x264 encoder\n");
+      exit (1);
+    }
+
+  if (x264_encoder_headers (e->enc, &e->headers, &e->headers_num) < 0)
+    {
+      fprintf (stderr, "couldn't configure x264 encoder\n");
+      exit (1);
+    }
+
+  /* x264 reuses this memory for the next frames, but every segment file
+     needs the headers again */
+  e->headers = copy_nals (e->headers, e->headers_num);
+
+  if (opts->replay_time)
+    {
+      /* nothing is written until asked, then the last seconds are saved
+	 into a numbered file */
+
+      memset (&e->replay, 0, sizeof (e->replay));
+      e->replay.duration = (double)opts->replay_time*1000000000
+	/opts->timestamp_scale;
+      e->replay.max_bytes = opts->replay_size ? opts->replay_size
+	: REPLAY_DEFAULT_SIZE;
+      pthread_mutex_init (&e->replay.lock, NULL);
+      pthread_cond_init (&e->replay.dump_finished, NULL);
+
+      memset (&sa, 0, sizeof (sa));
+      sa.sa_handler = request_replay_dump;
+      sa.sa_flags = SA_RESTART;
+      sigaction (SIGUSR1, &sa, NULL);
+
+      fprintf (stderr, "keeping the last %d seconds (at most %ld MB) in "
+	       "memory, send SIGUSR1 to process %d to save them\n\n",
+	       opts->replay_time, (long)(e->replay.max_bytes >> 20),
+	       (int)getpid ());
+    }
+  else
+    {
+      e->filename = e->segmenting
+	? make_segment_filename (opts->output, e->segment_num) : opts->output;
+
+      start_muxer (&e->mux, e->filename, opts, w, h,
+		   frame_duration*opts->recording_interval, e->headers,
+		   e->headers_num);
+    }
+}
+
+
+void
+encode_picture (struct encoding *e, unsigned char *pixels, long pts)
+{
+  struct recording_options *opts = e->opts;
+  struct muxer *mux = &e->mux;
+  x264_nal_t *nal;
+  long timestamp, dts;
+  int outsz, i_nal;
+
+
+  /* no pixels to drain the frames that x264 is holding back */
+
+  e->inframe.img.plane [0] = pixels;
+  e->inframe.i_pts = pts;
+
+  outsz = x264_encoder_encode (e->enc, &nal, &i_nal,
+			       pixels ? &e->inframe : NULL, &e->outframe);
+
+  if (outsz < 0)
+    {
+      fprintf (stderr, "couldn't encode framebuffer content\n");
+      exit (1);
+    }
+  else if (outsz)
+    {
+      timestamp = (double)e->outframe.i_pts*e->frame_duration
+	/opts->timestamp_scale+0.5;
+      dts = floor ((double)e->outframe.i_dts*e->frame_duration
+		   /opts->timestamp_scale+0.5);
+
+      if (opts->replay_time)
+	append_replay_frame (&e->replay, nal->p_payload, outsz, timestamp,
+			     dts, e->outframe.b_keyframe,
+			     e->outframe.i_type == X264_TYPE_B);
+      else
+	{
+	  /* a new segment starts at the first keyframe past the limits, so
+	     that every file is playable on its own */
+
+	  if (e->segmenting && e->outframe.b_keyframe && mux->frames_written
+	      && ((opts->segment_time
+		   && (timestamp-e->segment_start)*opts->timestamp_scale
+		   >= opts->segment_time*1000000000L)
+		  || (opts->segment_size
+		      && output_position (&mux->ob) >= opts->segment_size)))
+	    {
+	      fprintf (stderr, "closing %s\n", e->filename);
+	      finish_muxer (mux);
+	      free (e->filename);
+
+	      e->filename = make_segment_filename (opts->output,
+						   ++e->segment_num);
+	      start_muxer (mux, e->filename, opts, e->w, e->h,
+			   e->frame_duration*opts->recording_interval,
+			   e->headers, e->headers_num);
+	    }
+
+	  if (!mux->frames_written)
+	    e->segment_start = timestamp;
+
+	  /*if (i_nal > 1)
+	    {
+	      printf ("more than a nal produced\n");
+
+	      for (i = 0; i < i_nal; i++)
+		printf ("nal type is %d\n", nal [i].i_type);
+		}*/
+
+	  write_frame (mux, nal->p_payload, outsz, timestamp, dts,
+		       e->outframe.b_keyframe,
+		       e->outframe.i_type == X264_TYPE_B);
+	}
+    }
+
+  if (replay_dump_requested)
+    {
+      replay_dump_requested = 0;
+      dump_replay_buffer (&e->replay, opts, e->w, e->h,
+			  e->frame_duration*opts->recording_interval,
+			  e->headers, e->headers_num);
+    }
+}
+
+
+void
+end_encoding (struct encoding *e)
+{
+  int i;
+
+  while (x264_encoder_delayed_frames (e->enc))
+    encode_picture (e, NULL, 0);
+
+  finish_muxer (&e->mux);
+
+  x264_encoder_close (e->enc);
+  e->inframe.img.plane [0] = e->plane;
+  x264_picture_clean (&e->inframe);
+
+  for (i = 0; i < e->headers_num; i++)
+    free (e->headers [i].p_payload);
+
+  free (e->headers);
+}
+
+
+void
+finish_encoding_and_exit (struct encoding *e)
+{
+  if (e->opts->replay_time)
+    {
+      wait_for_replay_dumps (&e->replay);
+      exit (0);
+    }
+
+  if (!e->mux.streaming && e->mux.format == FORMAT_MATROSKA)
+    fprintf (stderr, "finishing and adding cues...\n");
+
+  finish_muxer (&e->mux);
+
+  exit (0);
+}
+
+
+int
+enter_pressed (void)
+{
+  struct pollfd pfd = {0, POLLIN};
+
+  if (poll (&pfd, 1, 0) < 0)
+    {
+      fprintf (stderr, "couldn't poll standard input\n");
+      exit (1);
+    }
+
+  return pfd.revents & POLLIN;
+}
+
+
+struct
+burst_shot
+{
+  struct burst_shot *next;
+  unsigned char *data;
+  size_t size;
+  char *filename;
+};
+
+
+struct
+burst_queue
+{
+  int done;
+  struct burst_shot *head, *tail;
+  pthread_mutex_t lock;
+  pthread_cond_t has_shots;
+};
+
+
+void *
+write_burst_shots (void *arg)
+{
+  struct burst_queue *q = arg;
+  struct burst_shot *shot;
+  int fd;
+
+  for (;;)
+    {
+      pthread_mutex_lock (&q->lock);
+
+      while (!q->head && !q->done)
+	pthread_cond_wait (&q->has_shots, &q->lock);
+
+      shot = q->head;
+
+      if (shot && !(q->head = shot->next))
+	q->tail = NULL;
+
+      pthread_mutex_unlock (&q->lock);
+
+      if (!shot)
+	return NULL;
+
+      fd = open_output_file (shot->filename, 0);
+      write_screenshot (fd, shot->data, shot->size);
+      close (fd);
+
+      free (shot->filename);
+      free (shot->data);
+      free (shot);
+    }
+}
+
+
+void
+take_burst_and_exit (struct recording_options *opts, int x, int y, int w,
+		     int h)
+{
+  struct screenshot s;
+  struct burst_queue q = {0};
+  struct burst_shot *shot;
+  drmVBlank vbl = {{DRM_VBLANK_RELATIVE, 1}};
+  struct timespec next, now;
+  pthread_t writer;
+  unsigned int first_vblank = 0, target;
+  int cardfd, n;
+
+
+  if (!opts->output || !strcmp (opts->output, "-"))
+    {
+      fprintf (stderr, "a burst requires an output file to name the "
+	       "screenshots after\n");
+      exit (1);
+    }
+
+  open_screenshot (&s, x, y, w, h, opts->format, &cardfd);
+
+
+  /* the files are written by another thread, so that a slow disk never
+     delays the next shot; the queue holds the shots meanwhile */
+
+  pthread_mutex_init (&q.lock, NULL);
+  pthread_cond_init (&q.has_shots, NULL);
+
+  if (pthread_create (&writer, NULL, write_burst_shots, &q))
+    {
+      fprintf (stderr, "couldn't create thread\n");
+      exit (1);
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &next);
+
+  for (n = 0; n < opts->burst; n++)
+    {
+      /* shots are timed from the first one, so a late shot doesn't
+	 shift the ones after it */
+
+      if (opts->burst_interval_ms)
 	{
-	case NAL_SPS:
-	  sps = &headers [i];
-	  break;
-	case NAL_PPS:
-	  pps = &headers [i];
-	  break;
+	  if (n)
+	    {
+	      next.tv_sec += opts->burst_interval/1000;
+	      next.tv_nsec += opts->burst_interval%1000*1000000L;
+
+	      if (next.tv_nsec >= 1000000000)
+		{
+		  next.tv_sec++;
+		  next.tv_nsec -= 1000000000;
+		}
+
+	      clock_gettime (CLOCK_MONOTONIC, &now);
+
+	      if (now.tv_sec > next.tv_sec
+		  || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+		fprintf (stderr, "warning: shot %d was late\n", n+1);
+
+	      while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+				      NULL) == EINTR);
+	    }
+	}
+      else
+	{
+	  /* the reply overwrites the request, so the target is kept aside;
+	     a vblank that has already passed is returned at once with the
+	     current count */
+
+	  target = vbl.request.sequence;
+
+	  if (drmWaitVBlank (cardfd, &vbl) < 0)
+	    {
+	      fprintf (stderr, "couldn't wait for vblank\n");
+	      exit (1);
+	    }
+
+	  if (!n)
+	    first_vblank = vbl.reply.sequence;
+	  else if (vbl.reply.sequence > target)
+	    fprintf (stderr, "warning: shot %d was late\n", n+1);
+
+	  vbl.request.type = DRM_VBLANK_ABSOLUTE;
+	  vbl.request.sequence = first_vblank+(n+1)*opts->burst_interval;
+	}
+
+      shot = malloc_and_check (sizeof (*shot));
+      shot->next = NULL;
+      shot->data = encode_screenshot (&s, &shot->size);
+      shot->filename = make_segment_filename (opts->output, n+1);
+
+      pthread_mutex_lock (&q.lock);
+
+      if (q.tail)
+	q.tail->next = shot;
+      else
+	q.head = shot;
+
+      q.tail = shot;
+      pthread_cond_signal (&q.has_shots);
+      pthread_mutex_unlock (&q.lock);
+    }
+
+  pthread_mutex_lock (&q.lock);
+  q.done = 1;
+  pthread_cond_signal (&q.has_shots);
+  pthread_mutex_unlock (&q.lock);
+
+  pthread_join (writer, NULL);
+
+  exit (0);
+}
+
+
+#define SCREENSHOT_CLIENTS 64
+
+
+/* the api of the screenshot daemon: a client connected to the unix socket
+   sends a request and gets a reply, then the image inline or as a sealed
+   memfd passed along with the reply; it can send as many requests as it
+   likes on the same connection */
+
+#define SCREENSHOT_PPM 0
+#define SCREENSHOT_PNG 1
+#define SCREENSHOT_QOI 2
+
+#define SCREENSHOT_MEMFD 1  /* flag to get a memfd instead of the data */
+
+
+struct
+screenshot_request
+{
+  int x, y, w, h;  /* a width or height of zero takes the rest of the screen */
+  int format;
+  int flags;
+};
+
+
+struct
+screenshot_reply
+{
+  int status;  /* zero, or an errno value */
+  int w, h;
+  int latency_us;  /* from the request to the encoded image */
+  long long size;  /* of the image that follows or is in the memfd */
+};
+
+
+struct
+screenshot_client  /* a connection to the screenshot daemon */
+{
+  struct screenshot_request req;
+  size_t got;  /* bytes of the request read so far */
+
+  /* a reply in progress, while there is one no new request is read */
+  int replying;
+  struct screenshot_reply rep;
+  unsigned char *data;  /* the inline image, if any */
+  int memfd;  /* passed with the first byte of the reply, or -1 */
+  size_t sent;  /* bytes of the reply and of the inline image */
+};
+
+
+int
+write_all (int fd, const void *buf, size_t size)
+{
+  size_t done = 0;
+  ssize_t ret;
+
+  while (done < size)
+    {
+      ret = write (fd, (const char *)buf+done, size-done);
+
+      if (ret < 0 && errno == EINTR)
+	continue;
+
+      if (ret == 0)
+	errno = EIO;  /* so that callers can report something */
+
+      if (ret <= 0)
+	return 0;
+
+      done += ret;
+    }
+
+  return 1;
+}
+
+
+int
+read_screenshot_request (struct screenshot_client *c, int fd)
+{
+  ssize_t ret;
+
+  /* the socket doesn't block, so a client that sends part of a request
+     and then stalls only holds up itself; -1 means it has to go */
+
+  do
+    {
+      ret = read (fd, (char *)&c->req+c->got, sizeof (c->req)-c->got);
+    } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+
+  if (ret <= 0)
+    return -1;
+
+  c->got += ret;
+  return c->got == sizeof (c->req);
+}
+
+
+void
+serve_screenshot_request (struct screenshot *s, struct screenshot_client *c,
+			  int screen_w, int screen_h)
+{
+  struct screenshot_request *req = &c->req;
+  struct screenshot_reply *rep = &c->rep;
+  struct timespec start, end;
+  unsigned char *data = NULL;
+  size_t size = 0;
+  enum output_format formats [] = {FORMAT_PPM, FORMAT_PNG, FORMAT_QOI};
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+
+  memset (rep, 0, sizeof (*rep));
+  c->memfd = -1;
+  c->data = NULL;
+  c->sent = 0;
+  c->replying = 1;
+  c->got = 0;
+
+  rep->w = req->w > 0 ? req->w : screen_w-req->x;
+  rep->h = req->h > 0 ? req->h : screen_h-req->y;
+
+  if (req->x < 0 || req->y < 0 || rep->w <= 0 || rep->h <= 0
+      || req->x+rep->w > screen_w || req->y+rep->h > screen_h
+      || req->format < SCREENSHOT_PPM || req->format > SCREENSHOT_QOI)
+    rep->status = EINVAL;
+  else
+    {
+      s->x = req->x;
+      s->y = req->y;
+      s->w = rep->w;
+      s->h = rep->h;
+      s->format = formats [req->format];
+
+      data = encode_screenshot (s, &size);
+      rep->size = size;
+
+      if (req->flags & SCREENSHOT_MEMFD)
+	{
+	  c->memfd = memfd_create ("screenrec-screenshot",
+				   MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	  if (c->memfd < 0 || !write_all (c->memfd, data, size))
+	    rep->status = errno;
+	  else
+	    {
+	      /* the client shares the file offset */
+
+	      lseek (c->memfd, 0, SEEK_SET);
+	      fcntl (c->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+		     | F_SEAL_WRITE | F_SEAL_SEAL);
+	    }
+
+	  free (data);
+	}
+      else
+	c->data = data;
+    }
+
+  if (rep->status && c->memfd >= 0)
+    {
+      close (c->memfd);
+      c->memfd = -1;
+    }
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  rep->latency_us = (end.tv_sec-start.tv_sec)*1000000
+    +(end.tv_nsec-start.tv_nsec)/1000;
+}
+
+
+void
+end_screenshot_reply (struct screenshot_client *c)
+{
+  if (c->memfd >= 0)
+    close (c->memfd);
+
+  free (c->data);
+  c->memfd = -1;
+  c->data = NULL;
+  c->replying = 0;
+}
+
+
+int
+send_screenshot_reply (struct screenshot_client *c, int fd)
+{
+  size_t total = sizeof (c->rep)+(c->data ? c->rep.size : 0);
+  struct iovec iov [2];
+  union
+  {
+    char buf [CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {0};
+  struct cmsghdr *cmsg;
+  ssize_t ret;
+
+  /* as much as the socket takes now, the rest when poll says there is
+     room again; the memfd goes with the first byte */
+
+  msg.msg_iov = iov;
+
+  if (c->sent < sizeof (c->rep))
+    {
+      iov [0].iov_base = (char *)&c->rep+c->sent;
+      iov [0].iov_len = sizeof (c->rep)-c->sent;
+      iov [1].iov_base = c->data;
+      iov [1].iov_len = c->data ? c->rep.size : 0;
+      msg.msg_iovlen = 2;
+    }
+  else
+    {
+      iov [0].iov_base = c->data+(c->sent-sizeof (c->rep));
+      iov [0].iov_len = total-c->sent;
+      msg.msg_iovlen = 1;
+    }
+
+  if (!c->sent && c->memfd >= 0)
+    {
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof (control.buf);
+      cmsg = CMSG_FIRSTHDR (&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+      memcpy (CMSG_DATA (cmsg), &c->memfd, sizeof (int));
+    }
+
+  do
+    {
+      ret = sendmsg (fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+
+  if (ret <= 0)
+    return -1;
+
+  c->sent += ret;
+
+  if (c->sent < total)
+    return 0;
+
+  end_screenshot_reply (c);
+  return 1;
+}
+
+
+volatile sig_atomic_t serving_stopped;
+
+
+void
+stop_serving (int sig)
+{
+  serving_stopped = 1;
+}
+
+
+void
+serve_screenshots_and_exit (char *path)
+{
+  struct screenshot s;
+  struct sockaddr_un addr = {AF_UNIX};
+  struct pollfd pfds [SCREENSHOT_CLIENTS+2];
+  struct screenshot_client clients [SCREENSHOT_CLIENTS+2], *cl;
+  struct sigaction sa = {0};
+  char *uid = getenv ("SUDO_UID"), *gid = getenv ("SUDO_GID"), c;
+  long served = 0, total_latency = 0, max_latency = 0;
+  int cardfd, sock, conn, nfds = 2, screen_w, screen_h, i, ret;
+
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+      fprintf (stderr, "socket path %s is too long\n", path);
+      exit (1);
+    }
+
+  strcpy (addr.sun_path, path);
+
+  /* the framebuffer stays mapped and the conversion threads stay up, so
+     a request only pays for converting and sending */
+
+  open_screenshot (&s, 0, 0, -1, -1, FORMAT_PNG, &cardfd);
+  screen_w = s.w;
+  screen_h = s.h;
+
+  signal (SIGPIPE, SIG_IGN);
+
+  /* without SA_RESTART, so that poll returns */
+
+  sa.sa_handler = stop_serving;
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+
+  sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink (path);
+
+  if (sock < 0 || bind (sock, (struct sockaddr *)&addr, sizeof (addr)) < 0
+      || listen (sock, SCREENSHOT_CLIENTS) < 0)
+    {
+      fprintf (stderr, "couldn't listen on %s: ", path);
+      perror ("");
+      exit (1);
+    }
+
+  /* like the ring of a capture daemon, the socket is given to the sudo
+     user so that clients don't need root */
+
+  if (uid && gid && chown (path, atoi (uid), atoi (gid)) < 0)
+    fprintf (stderr, "warning: couldn't give %s to the sudo user\n", path);
+
+  fprintf (stderr, "serving screenshots on %s, press ENTER to stop\n\n",
+	   path);
+
+  pfds [0].fd = 0;
+  pfds [0].events = POLLIN;
+  pfds [1].fd = sock;
+  pfds [1].events = POLLIN;
+
+  while (!serving_stopped)
+    {
+      if (poll (pfds, nfds, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  fprintf (stderr, "couldn't poll screenshot clients\n");
+	  exit (1);
+	}
+
+      /* without a terminal, for example when started by a service
+	 manager, standard input is at its end and only SIGTERM or SIGINT
+	 stop us */
+
+      if (pfds [0].revents && read (0, &c, 1) > 0)
+	break;
+
+      if (pfds [0].revents)
+	pfds [0].fd = -1;
+
+      if (pfds [1].revents & POLLIN
+	  && (conn = accept4 (sock, NULL, NULL,
+			      SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+	{
+	  if (nfds < SCREENSHOT_CLIENTS+2)
+	    {
+	      pfds [nfds].fd = conn;
+	      pfds [nfds].events = POLLIN;
+	      memset (&clients [nfds], 0, sizeof (clients [nfds]));
+	      clients [nfds++].memfd = -1;
+	    }
+	  else
+	    close (conn);
+	}
+
+      /* a client is either sending a request or getting a reply, and
+	 waits for its socket alone, so that a slow one can't hold up the
+	 others */
+
+      for (i = 2; i < nfds; i++)
+	{
+	  cl = &clients [i];
+
+	  if (!pfds [i].revents)
+	    continue;
+
+	  if (!cl->replying)
+	    {
+	      ret = read_screenshot_request (cl, pfds [i].fd);
+
+	      if (ret > 0)
+		{
+		  serve_screenshot_request (&s, cl, screen_w, screen_h);
+		  ret = send_screenshot_reply (cl, pfds [i].fd);
+		}
+	    }
+	  else
+	    ret = send_screenshot_reply (cl, pfds [i].fd);
+
+	  if (ret > 0)
+	    {
+	      served++;
+	      total_latency += cl->rep.latency_us;
+	      max_latency = cl->rep.latency_us > max_latency
+		? cl->rep.latency_us : max_latency;
+	    }
+
+	  if (ret < 0)
+	    {
+	      end_screenshot_reply (cl);
+	      close (pfds [i].fd);
+	      pfds [i] = pfds [--nfds];
+	      clients [i--] = clients [nfds];
+	      continue;
+	    }
+
+	  pfds [i].events = cl->replying ? POLLOUT : POLLIN;
 	}
     }
 
-  if (!sps || !pps)
+  close (sock);
+  unlink (path);
+
+  if (served)
+    fprintf (stderr, "served %ld screenshots, latency %ld us on average, "
+	     "%ld us at most\n", served, total_latency/served, max_latency);
+
+  exit (0);
+}
+
+
+void
+record_screen_and_exit (struct recording_options *opts, int x, int y, int w,
+			int h)
+{
+  drmModeFB2 *fb2;
+  drmVBlank vbl = {{DRM_VBLANK_RELATIVE, 1}};
+  struct thread_args *args;
+  pthread_t *threads;
+  struct stat statbuf;
+  struct encoding e;
+  struct frame_ring ring;
+  struct remote_capture remote;
+  struct raw_output raw;
+  char *buf;
+  unsigned char *out;
+  long frames_since_start = 0;
+  int i, dmabuf_fd, cardfd, native_refresh, frame_duration, last_vblank = -1,
+    nthreads, encoding_here = !opts->capture_to && !opts->send_to
+    && opts->format != FORMAT_RAW;
+
+
+  /* a capture daemon only fills the ring, the encoding is done by another
+     process reading from it or by remote workers */
+
+  if (encoding_here)
+    check_output_options (opts);
+
+  dmabuf_fd = open_framebuffer (&fb2, &cardfd, &native_refresh);
+
+
+  w = w < 0 ? fb2->width-x : w;
+  h = h < 0 ? fb2->height-y : h;
+
+  if (w <= 0 || h <= 0 || x+w > fb2->width || y+h > fb2->height)
     {
-      fprintf (stderr, "couldn't configure x264 encoder\n");
+      fprintf (stderr, "out-of-bound geometry in -g option\n");
       exit (1);
     }
 
-  avcrec_sz = sizeof (avcrec_header)+3+sps->i_payload+3+pps->i_payload;
 
-  header_sz = sizeof (ebml_header)+sizeof (segment_header)+sizeof (tracks_header)
-    +sizeof (codec_private_header)+avcrec_sz+sizeof (other_headers);
-  header = malloc_and_check (header_sz);
-
-  for (i = 0; i < sizeof (ebml_header); i++)
+  if (native_refresh < 0)
     {
-      header [i] = ebml_header [i];
+      fprintf (stderr, "warning: couldn't determine native refresh rate, "
+	       "assuming 60 hz\n");
+      native_refresh = 60;
     }
 
-  for (j = 0; j < sizeof (segment_header); j++)
+  frame_duration = (int) (1000000000.0/native_refresh+0.5);
+
+  if (fstat (dmabuf_fd, &statbuf) < 0)
     {
-      header [i++] = segment_header [j];
+      fprintf (stderr, "couldn't stat dmabuf of the framebuffer\n");
+      exit (1);
     }
 
-  for (j = 0; j < sizeof (tracks_header); j++)
+  buf = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, dmabuf_fd,
+	      fb2->offsets [0]);
+
+  if (buf == (void *) -1)
     {
-      header [i++] = tracks_header [j];
+      fprintf (stderr, "couldn't mmap dmabuf of the framebuffer\n");
+      exit (1);
     }
 
-  for (j = 0; j < sizeof (codec_private_header); j++)
+  fprintf (stderr, "warning: assuming pixel format XR24...\n");
+  fprintf (stderr, "warning: assuming pixel order tiled X by 4 KB...\n\n");
+
+  fprintf (stderr, "press ENTER to stop recording\n\n");
+
+  if (encoding_here)
+    start_encoding (&e, opts, w, h, frame_duration);
+  else if (opts->format == FORMAT_RAW)
+    start_raw_output (&raw, opts, w, h);
+
+  /* when publishing frames, every frame is detiled straight into its slot
+     of the ring and encoded from there */
+
+  if (opts->ring_slots)
     {
-      header [i++] = codec_private_header [j];
+      open_frame_ring (&ring, opts->ring_slots, w, h, frame_duration,
+		       opts->capture_to ? opts->capture_to : opts->publish_to,
+		       !!opts->capture_to);
+      out = NULL;
     }
+  else if (opts->send_to || opts->format == FORMAT_RAW)
+    out = NULL;
+  else
+    out = malloc_and_check (w*h*3);
+
+
+  nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+
+  args = malloc_and_check (sizeof (*args) * nthreads);
+  may_start = malloc_and_check (sizeof (*may_start) * nthreads);
+  threads = malloc_and_check (sizeof (*threads) * nthreads);
 
-  for (j = 0; j < sizeof (avcrec_header); j++)
+  for (i = 0; i < nthreads; i++)
     {
-      header [i++] = avcrec_header [j];
+      args [i].index = i;
+      args [i].total = nthreads;
+
+      args [i].out = out;
+      args [i].in = buf;
+      args [i].x = x;
+      args [i].y = y;
+      args [i].w = w;
+      args [i].h = h;
+      args [i].p = fb2->pitches [0];
+      args [i].prev = NULL;
+      args [i].delta = NULL;
+
+      sem_init (&may_start [i], 0, 0);
+
+      if (pthread_create (&threads [i], NULL, rearrange_rows, &args [i]))
+	{
+	  fprintf (stderr, "couldn't create thread\n");
+	  exit (1);
+	}
     }
 
-  header [i++] = 0xe1;
-  header [i++] = (sps->i_payload >> 8) & 0xff;
-  header [i++] = sps->i_payload & 0xff;
-  memcpy (header+i, sps->p_payload, sps->i_payload);
-  i += sps->i_payload;
+  sem_init (&has_finished, 0, 0);
 
-  header [i++] = 0x01;
-  header [i++] = (pps->i_payload >> 8) & 0xff;
-  header [i++] = pps->i_payload & 0xff;
-  memcpy (header+i, pps->p_payload, pps->i_payload);
-  i += pps->i_payload;
+  if (opts->send_to)
+    start_remote_capture (&remote, opts, w, h, frame_duration, args,
+			  nthreads);
 
-  /*fprintf (stderr, "avcrec_sz is %d\n", avcrec_sz);*/
 
-  if (avcrec_sz > 126)
+  for (;;)
     {
-      fprintf (stderr, "avcrec_sz too big\n");
-      exit (1);
-    }
+      /* the capture daemon can't overwrite frames that the encoder has
+	 yet to read, so it waits for a free slot while still listening
+	 for ENTER */
 
-  header [sizeof (ebml_header)+sizeof (segment_header)+sizeof (tracks_header)+2]
-    = 0x80 | avcrec_sz;
+      if (opts->capture_to && !wait_for_ring_room (&ring))
+	{
+	  if (enter_pressed ())
+	    break;
 
+	  continue;
+	}
 
-  default_duration *= 1;
+      if (drmWaitVBlank (cardfd, &vbl) < 0)
+	{
+	  fprintf (stderr, "couldn't wait for vblank\n");
+	  exit (1);
+	}
 
-  header [sizeof (ebml_header)+sizeof (segment_header)+21]
-    = (default_duration & 0xff000000) >> 24;
-  header [sizeof (ebml_header)+sizeof (segment_header)+22]
-    = (default_duration & 0xff0000) >> 16;
-  header [sizeof (ebml_header)+sizeof (segment_header)+23]
-    = (default_duration & 0xff00) >> 8;
-  header [sizeof (ebml_header)+sizeof (segment_header)+24]
-    = default_duration & 0xff;
+      if (last_vblank < 0)  /* first iteration */
+	{
+	  last_vblank = vbl.reply.sequence;
 
+	  vbl.request.type = DRM_VBLANK_ABSOLUTE;
+	}
+      else
+	{
+	  if (opts->recording_interval < vbl.reply.sequence - last_vblank)
+	    {
+	      fprintf (stderr, "warning: at least a frame was skipped\n");
+	    }
 
-  header [sizeof (ebml_header)+sizeof (segment_header)+29] = (width & 0xff00) >> 8;
-  header [sizeof (ebml_header)+sizeof (segment_header)+30] = width & 0xff;
-  header [sizeof (ebml_header)+sizeof (segment_header)+33] = (height & 0xff00) >> 8;
-  header [sizeof (ebml_header)+sizeof (segment_header)+34] = height & 0xff;
+	  frames_since_start += vbl.reply.sequence-last_vblank;
+	  last_vblank = vbl.reply.sequence;
+	}
 
-  if (sizeof (tracks_header)-7+sizeof (codec_private_header)+avcrec_sz > 126)
-    {
-      fprintf (stderr, "track entry too big\n");
-      exit (1);
-    }
+      vbl.request.sequence = vbl.reply.sequence+opts->recording_interval;
 
-  header [sizeof (ebml_header)+sizeof (segment_header)+6]
-    = 0x80 | (sizeof (tracks_header)-7+sizeof (codec_private_header)+avcrec_sz);
 
-  if (sizeof (tracks_header)-5+sizeof (codec_private_header)+avcrec_sz > 126)
-    {
-      fprintf (stderr, "tracks too big\n");
-      exit (1);
-    }
+      if (opts->ring_slots)
+	out = begin_ring_frame (&ring, args, nthreads);
+      else if (opts->send_to)
+	out = begin_remote_frame (&remote, args);
+      else if (opts->format == FORMAT_RAW)
+	out = begin_raw_frame (&raw, args, nthreads);
 
-  header [sizeof (ebml_header)+sizeof (segment_header)+4]
-    = 0x80 | (sizeof (tracks_header)-5+sizeof (codec_private_header)+avcrec_sz);
+      /*fprintf (stderr, "posting may_start semaphores\n");*/
 
+      for (i = 0; i < nthreads; i++)
+	{
+	  sem_post (&may_start [i]);
+	}
 
-  *seekhead_offs = i;
+      /*fprintf (stderr, "waiting has_finished semaphore\n");*/
 
-  for (j = 0; j < sizeof (other_headers); j++)
-    {
-      header [i++] = other_headers [j];
-    }
+      for (i = 0; i < nthreads; i++)
+	{
+	  sem_wait (&has_finished);
+	}
 
-  header [*seekhead_offs+32] = *seekhead_offs+50-SEGMENT_BODY_START;
+      /*fprintf (stderr, "got has_finished semaphore\n");*/
 
-  if (lseek (outfd, 0, SEEK_SET) < 0)
-    {
-      fprintf (stderr, "couldn't seek in output file\n");
-      exit (1);
+
+      /*convert_tiledx4kb_pixels_to_linear (out, buf, w, h, fb2->pitches [0], 0);*/
+
+      if (opts->ring_slots)
+	publish_ring_frame (&ring, args, nthreads,
+			    (long long)frames_since_start*frame_duration);
+
+      if (opts->send_to)
+	send_remote_frame (&remote, frames_since_start);
+      else if (opts->format == FORMAT_RAW)
+	write_raw_frame (&raw);
+
+      if (encoding_here)
+	encode_picture (&e, out, frames_since_start);
+
+      if (enter_pressed ())
+	break;
     }
 
-  for (i = 0; i < header_sz; i++)
+  if (opts->capture_to)
     {
-      write_char (outfd, header [i]);
+      close_frame_ring (&ring);
+      exit (0);
     }
+
+  if (opts->send_to)
+    finish_remote_capture_and_exit (&remote);
+
+  if (opts->format == FORMAT_RAW)
+    finish_raw_output_and_exit (&raw);
+
+  finish_encoding_and_exit (&e);
 }
 
 
 void
-write_cluster_header (int outfd, long timestamp)
+encode_from_ring_and_exit (struct recording_options *opts, char *path)
 {
-  int i;
-  unsigned char cluster_header [] =
-    {0x1f, 0x43, 0xb6, 0x75, 0xff, 0xff, 0xff, 0xff, /* cluster header */
-     0xe7, 0x88 /* timestamp */ };
+  struct frame_ring ring;
+  struct frame_slot *slot;
+  struct encoding e;
+  unsigned int frame;
+
+
+  check_output_options (opts);
 
-  for (i = 0; i < sizeof (cluster_header); i++)
+  attach_frame_ring (&ring, path);
+
+  fprintf (stderr, "press ENTER to stop encoding\n\n");
+
+  start_encoding (&e, opts, ring.header->width, ring.header->height,
+		  ring.header->frame_duration);
+
+  /* a restarted encoder goes on from the first frame its predecessor
+     didn't finish */
+
+  frame = __atomic_load_n (&ring.header->consumed, __ATOMIC_ACQUIRE);
+
+  while (!enter_pressed ())
     {
-      write_char (outfd, cluster_header [i]);
+      if (!wait_for_ring_frame (&ring, frame))
+	{
+	  if (__atomic_load_n (&ring.header->closed, __ATOMIC_ACQUIRE)
+	      && frame == __atomic_load_n (&ring.header->published,
+					   __ATOMIC_ACQUIRE))
+	    break;
+
+	  continue;
+	}
+
+      slot = ring_slot (&ring, frame);
+
+      /* x264 copies the picture before returning, so the slot can be
+	 handed back right after */
+
+      encode_picture (&e, (unsigned char *)slot+FRAME_RING_PAGE,
+		      (slot->timestamp+ring.header->frame_duration/2)
+		      /ring.header->frame_duration);
+
+      release_ring_frame (&ring, ++frame);
     }
 
-  write_int64_bigend (outfd, timestamp);
+  finish_encoding_and_exit (&e);
 }
 
-
 struct
-thread_args
+remote_frame
 {
-  int index;
-  int total;
-
-  unsigned char *out;
-  char *in;
-  int x, y, w, h, p;
-  enum pixel_format pf;
+  struct remote_frame *next;
+  unsigned char *data;  /* the frame header, then the strips */
+  size_t size;
 };
 
-sem_t *may_start;
-sem_t has_finished;
 
+#define REMOTE_QUEUE_MAX (256L << 20)  /* bytes of frames not yet encoded */
 
-void *
-rearrange_rows (void *args)
+
+struct
+remote_queue
 {
-  struct thread_args *arg = args;
-  int destind, srcind, i, j, striph = ceil ((double)arg->h/arg->total);
+  int sock, strips, done;
+  struct remote_frame *head, *tail;
+  size_t bytes;
+  pthread_mutex_t lock;
+  pthread_cond_t has_frames, has_room;
+};
 
 
-  /*fprintf (stderr, "thread %d started, strips are %d high\n", arg->index, striph);*/
+int
+recv_fully (int sock, unsigned char *buf, size_t len)
+{
+  size_t got = 0;
+  ssize_t ret;
 
-  for (;;)
+  /* zero means that the client closed the connection between frames */
+
+  while (got < len)
     {
-      /*fprintf (stderr, "thread %d waiting for may_start semaphore\n", arg->index);*/
-      sem_wait (&may_start [arg->index]);
-      /*fprintf (stderr, "thread %d got may_start semaphore\n", arg->index);*/
+      ret = read (sock, buf+got, len-got);
 
-      destind = arg->index*striph*arg->w*3;
+      if (ret < 0 && errno == EINTR)
+	continue;
 
-      for (j = arg->y+arg->index*striph; j < arg->y+(arg->index+1)*striph
-	     && j < arg->y+arg->h; j++)
+      if (ret < 0 || (!ret && got))
 	{
-	  for (i = arg->x; i < arg->x+arg->w; i++)
-	    {
-	      srcind = j/8*4096*(arg->p/512)+i/128*4096+(j%8)*512+(i%128)*4;
+	  fprintf (stderr, "couldn't receive frame from capture client\n");
+	  exit (1);
+	}
 
-	      arg->out [destind] = arg->in [srcind+2];
-	      arg->out [destind+1] = arg->in [srcind+1];
-	      arg->out [destind+2] = arg->in [srcind];
+      if (!ret)
+	return 0;
 
-	      destind += 3;
-	    }
+      got += ret;
+    }
+
+  return 1;
+}
+
+
+void *
+receive_remote_frames (void *arg)
+{
+  struct remote_queue *q = arg;
+  size_t header_size = REMOTE_FRAME_HEADER_SIZE+4*q->strips, size;
+  unsigned char *header = malloc_and_check (header_size);
+  struct remote_frame *fr;
+  int i;
+
+  /* frames are read as soon as they come, so that the client doesn't
+     wait for us to encode a slow frame; the queue holds them meanwhile,
+     and when it is full we stop reading and let tcp flow control hold
+     the client back */
+
+  while (recv_fully (q->sock, header, header_size))
+    {
+      if (load_bigend (header+12, 4) != q->strips)
+	{
+	  fprintf (stderr, "capture client sent a malformed frame\n");
+	  exit (1);
 	}
 
-      /*fprintf (stderr, "thread %d posting has_finished semaphore\n", arg->index);*/
-      sem_post (&has_finished);
+      for (i = 0, size = header_size; i < q->strips; i++)
+	size += load_bigend (header+REMOTE_FRAME_HEADER_SIZE+4*i, 4);
+
+      fr = malloc_and_check (sizeof (*fr));
+      fr->next = NULL;
+      fr->size = size;
+      fr->data = malloc_and_check (size);
+      memcpy (fr->data, header, header_size);
+
+      if (!recv_fully (q->sock, fr->data+header_size, size-header_size)
+	  && size > header_size)
+	{
+	  fprintf (stderr, "capture client closed the connection in the "
+		   "middle of a frame\n");
+	  exit (1);
+	}
+
+      pthread_mutex_lock (&q->lock);
+
+      if (q->tail)
+	q->tail->next = fr;
+      else
+	q->head = fr;
+
+      q->tail = fr;
+      q->bytes += size;
+      pthread_cond_signal (&q->has_frames);
+
+      while (q->bytes >= REMOTE_QUEUE_MAX)
+	pthread_cond_wait (&q->has_room, &q->lock);
+
+      pthread_mutex_unlock (&q->lock);
     }
 
-  fprintf (stderr, "thread %d finished\n", arg->index);
+  pthread_mutex_lock (&q->lock);
+  q->done = 1;
+  pthread_cond_signal (&q->has_frames);
+  pthread_mutex_unlock (&q->lock);
 
+  free (header);
   return NULL;
 }
 
 
-void
-record_screen_and_exit (char *output, char *preset, int x, int y, int w, int h,
-			int recording_interval)
+int
+accept_capture_client (char *port)
 {
-  x264_param_t par;
-  x264_picture_t inframe, outframe;
-  x264_nal_t *nal, *headers;
-  x264_t *enc;
-  drmModeFB2 *fb2;
-  drmVBlank vbl = {{DRM_VBLANK_RELATIVE, 1}};
-  struct thread_args *args;
-  pthread_t *threads;
-  struct cue_vector cue_vectors = {{{0}}}, *cuevec = &cue_vectors;
-  struct stat statbuf;
-  struct pollfd pfd = {0, POLLIN};
-  off_t off, seekh_off;
-  char *buf;
-  unsigned char *out;
-  long timestamp_of_cluster;
-  int i, outfd, dmabuf_fd, cardfd, native_refresh, frame_duration,
-    num_frames_within_cluster, outsz, i_nal, headers_num,
-    timestamp_within_cluster, cluster_offset_within_segment, cluster_size,
-    last_vblank = -1, cueind = 0, cues_size, nthreads;
+  struct addrinfo hints = {0}, *res, *ai;
+  int sock = -1, conn, err, one = 1;
 
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
 
-  dmabuf_fd = open_framebuffer (&fb2, &cardfd, &native_refresh);
+  if ((err = getaddrinfo (NULL, port, &hints, &res)))
+    {
+      fprintf (stderr, "couldn't resolve port %s: %s\n", port,
+	       gai_strerror (err));
+      exit (1);
+    }
 
+  /* the ipv6 wildcard takes ipv4 clients too, but it may be missing */
 
-  w = w < 0 ? fb2->width-x : w;
-  h = h < 0 ? fb2->height-y : h;
+  for (ai = res; ai && sock < 0; ai = ai->ai_next)
+    {
+      sock = socket (ai->ai_family, SOCK_STREAM, 0);
 
-  if (w <= 0 || h <= 0 || x+w > fb2->width || y+h > fb2->height)
+      if (sock >= 0
+	  && (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &one,
+			  sizeof (one)) < 0
+	      || bind (sock, ai->ai_addr, ai->ai_addrlen) < 0
+	      || listen (sock, 1) < 0))
+	{
+	  close (sock);
+	  sock = -1;
+	}
+    }
+
+  if (sock < 0)
     {
-      fprintf (stderr, "out-of-bound geometry in -g option\n");
+      fprintf (stderr, "couldn't listen on port %s: ", port);
+      perror ("");
       exit (1);
     }
 
+  freeaddrinfo (res);
 
-  if (native_refresh < 0)
+  fprintf (stderr, "waiting for a capture client on port %s\n\n", port);
+
+  conn = accept (sock, NULL, NULL);
+
+  if (conn < 0)
     {
-      fprintf (stderr, "warning: couldn't determine native refresh rate, "
-	       "assuming 60 hz\n");
-      native_refresh = 60;
+      fprintf (stderr, "couldn't accept connection: ");
+      perror ("");
+      exit (1);
     }
 
-  frame_duration = (int) (1000000000.0/native_refresh+0.5);
+  close (sock);
+  return conn;
+}
 
 
-  if (x264_param_default_preset (&par, preset, NULL) < 0)
+void
+unpack_strip (unsigned char *frame, unsigned char *raw, size_t raw_size,
+	      unsigned char *packed, size_t packed_len, int w, int row,
+	      int rows)
+{
+  int tiles = (w+TILE_WIDTH-1)/TILE_WIDTH, t, j, tw;
+  size_t stride = w*3;
+  uLongf len = raw_size;
+  unsigned char *p = raw+tiles;
+
+  if (uncompress (raw, &len, packed, packed_len) != Z_OK)
     {
-      fprintf (stderr, "couldn't configure x264 encoder\n");
+      fprintf (stderr, "capture client sent a corrupted frame\n");
       exit (1);
     }
 
-  par.i_bitdepth = 8;
-  /*par.i_csp = X264_CSP_I420;*/
-  par.i_csp = X264_CSP_RGB;
-  par.i_width = w;
-  par.i_height = h;
-  par.b_vfr_input = 0;
-  par.b_repeat_headers = 0;
-  par.b_annexb = 1;
+  for (t = 0; t < tiles; t++)
+    {
+      if (!raw [t])
+	continue;
+
+      tw = (t < tiles-1 ? TILE_WIDTH : w-t*TILE_WIDTH)*3;
+
+      if (p+rows*tw > raw+len)
+	{
+	  fprintf (stderr, "capture client sent a corrupted frame\n");
+	  exit (1);
+	}
 
-  if (x264_param_apply_profile (&par, "high444") < 0)
-    {
-      fprintf (stderr, "couldn't configure x264 encoder\n");
-      exit (1);
+      for (j = 0; j < rows; j++, p += tw)
+	memcpy (frame+(row+j)*stride+t*TILE_WIDTH*3, p, tw);
     }
+}
 
-  if (x264_picture_alloc (&inframe, X264_CSP_RGB, w, h) < 0)
+
+void
+run_encode_worker_and_exit (struct recording_options *opts, char *port)
+{
+  struct remote_queue q = {0};
+  struct remote_frame *fr;
+  struct recording_options gop_opts = *opts;
+  struct encoding e;
+  unsigned char header [REMOTE_STREAM_HEADER_SIZE], *frame, *raw, *strip;
+  int w, h, striph, frame_duration, i, rows, encoding = 0, gops = 0;
+  unsigned int gop = 0;
+  size_t raw_size, len;
+  pthread_t reader;
+
+
+  /* every group of pictures goes to its own numbered file, like the
+     segments of a local recording, so that the files written by all the
+     workers follow each other */
+
+  if (!opts->output || !strcmp (opts->output, "-") || opts->segment_time
+      || opts->segment_size || opts->replay_time || opts->udp_dest)
     {
-      fprintf (stderr, "couldn't configure x264 encoder\n");
+      fprintf (stderr, "an encode worker needs an output file to number "
+	       "and can't split, replay or stream it\n");
       exit (1);
     }
 
-  enc = x264_encoder_open (&par);
+  q.sock = accept_capture_client (port);
 
-  if (!enc)
+  if (!recv_fully (q.sock, header, sizeof (header))
+      || load_bigend (header, 4) != REMOTE_MAGIC)
     {
-      fprintf (stderr, "couldn't configure x264 encoder\n");
+      fprintf (stderr, "the client is not a screenrec capture client\n");
       exit (1);
     }
 
-  if (fstat (dmabuf_fd, &statbuf) < 0)
+  w = load_bigend (header+4, 4);
+  h = load_bigend (header+8, 4);
+  frame_duration = load_bigend (header+12, 4);
+  gop_opts.recording_interval = load_bigend (header+16, 4);
+  q.strips = load_bigend (header+20, 4);
+
+  if (w <= 0 || h <= 0 || frame_duration <= 0 || q.strips <= 0
+      || gop_opts.recording_interval <= 0)
     {
-      fprintf (stderr, "couldn't stat dmabuf of the framebuffer\n");
+      fprintf (stderr, "capture client sent a malformed stream header\n");
       exit (1);
     }
 
-  buf = mmap (NULL, statbuf.st_size, PROT_READ, MAP_SHARED, dmabuf_fd,
-	      fb2->offsets [0]);
+  striph = ceil ((double)h/q.strips);
+  raw_size = (w+TILE_WIDTH-1)/TILE_WIDTH+(size_t)striph*w*3;
+  raw = malloc_and_check (raw_size);
+  frame = malloc_and_check ((size_t)w*h*3);
 
-  if (buf == (void *) -1)
+  pthread_mutex_init (&q.lock, NULL);
+  pthread_cond_init (&q.has_frames, NULL);
+  pthread_cond_init (&q.has_room, NULL);
+
+  if (pthread_create (&reader, NULL, receive_remote_frames, &q))
     {
-      fprintf (stderr, "couldn't mmap dmabuf of the framebuffer\n");
+      fprintf (stderr, "couldn't create thread\n");
       exit (1);
     }
 
-  if (x264_encoder_headers (enc, &headers, &headers_num) < 0)
+  for (;;)
     {
-      fprintf (stderr, "couldn't configure x264 encoder\n");
-      exit (1);
-    }
+      pthread_mutex_lock (&q.lock);
 
-  fprintf (stderr, "warning: assuming pixel format XR24...\n");
-  fprintf (stderr, "warning: assuming pixel order tiled X by 4 KB...\n\n");
+      while (!q.head && !q.done)
+	pthread_cond_wait (&q.has_frames, &q.lock);
 
-  fprintf (stderr, "press ENTER to stop recording\n\n");
+      fr = q.head;
 
-  outfd = open (output, O_RDWR | O_CREAT | O_TRUNC);
+      if (fr && !(q.head = fr->next))
+	q.tail = NULL;
 
-  if (outfd < 0)
-    {
-      fprintf (stderr, "couldn't open %s: ", output);
-      perror ("");
-    }
+      pthread_mutex_unlock (&q.lock);
 
-  write_minimal_matroska_header (outfd, w, h, frame_duration*recording_interval,
-				 headers, headers_num, &seekh_off);
+      if (!fr)
+	break;
 
-  timestamp_of_cluster = 0;
-  cluster_offset_within_segment = lseek (outfd, 0, SEEK_CUR)-SEGMENT_BODY_START;
-  write_cluster_header (outfd, timestamp_of_cluster);
-  num_frames_within_cluster = 0;
-  timestamp_within_cluster = 0;
-  cluster_size = 10;
+      if (!encoding || load_bigend (fr->data, 4) != gop)
+	{
+	  if (encoding)
+	    {
+	      end_encoding (&e);
+	      free (gop_opts.output);
+	    }
 
-  out = malloc_and_check (w*h*3);
-  inframe.img.plane [0] = out;
+	  gop = load_bigend (fr->data, 4);
+	  gop_opts.output = make_segment_filename (opts->output, gop+1);
+	  start_encoding (&e, &gop_opts, w, h, frame_duration);
+	  encoding = 1;
+	  gops++;
+	}
 
+      strip = fr->data+REMOTE_FRAME_HEADER_SIZE+4*q.strips;
 
-  nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+      for (i = 0; i < q.strips; i++)
+	{
+	  len = load_bigend (fr->data+REMOTE_FRAME_HEADER_SIZE+4*i, 4);
+	  rows = h-i*striph < striph ? h-i*striph : striph;
 
-  args = malloc_and_check (sizeof (*args) * nthreads);
-  may_start = malloc_and_check (sizeof (*may_start) * nthreads);
-  threads = malloc_and_check (sizeof (*threads) * nthreads);
+	  if (len && rows > 0)
+	    unpack_strip (frame, raw, raw_size, strip, len, w, i*striph, rows);
 
-  for (i = 0; i < nthreads; i++)
-    {
-      args [i].index = i;
-      args [i].total = nthreads;
+	  strip += len;
+	}
 
-      args [i].out = out;
-      args [i].in = buf;
-      args [i].x = x;
-      args [i].y = y;
-      args [i].w = w;
-      args [i].h = h;
-      args [i].p = fb2->pitches [0];
+      encode_picture (&e, frame, load_bigend (fr->data+4, 8));
 
-      sem_init (&may_start [i], 0, 0);
+      pthread_mutex_lock (&q.lock);
+      q.bytes -= fr->size;
+      pthread_cond_signal (&q.has_room);
+      pthread_mutex_unlock (&q.lock);
 
-      if (pthread_create (&threads [i], NULL, rearrange_rows, &args [i]))
-	{
-	  fprintf (stderr, "couldn't create thread\n");
-	  exit (1);
-	}
+      free (fr->data);
+      free (fr);
     }
 
-  sem_init (&has_finished, 0, 0);
+  if (encoding)
+    end_encoding (&e);
+
+  fprintf (stderr, "encoded %d groups of pictures\n", gops);
+  exit (0);
+}
 
 
-  for (;;)
+void
+pwrite_fully (int fd, const void *data, size_t sz, off_t pos)
+{
+  if (pwrite (fd, data, sz, pos) != sz)
     {
-      if (drmWaitVBlank (cardfd, &vbl) < 0)
-	{
-	  fprintf (stderr, "couldn't wait for vblank\n");
-	  exit (1);
-	}
+      fprintf (stderr, "couldn't write to file: ");
+      perror ("");
+      exit (1);
+    }
+}
 
-      if (last_vblank < 0)  /* first iteration */
-	{
-	  last_vblank = vbl.reply.sequence;
 
-	  vbl.request.type = DRM_VBLANK_ABSOLUTE;
-	}
-      else
-	{
-	  if (recording_interval < vbl.reply.sequence - last_vblank)
-	    {
-	      fprintf (stderr, "warning: at least a frame was skipped\n");
-	    }
+int
+read_element_header (int fd, off_t pos, off_t end, unsigned long *id,
+		     long *size, int *header_len)
+{
+  unsigned char b [12];
+  int n = end-pos < 12 ? end-pos : 12, idlen, szlen, i;
 
-	  num_frames_within_cluster += vbl.reply.sequence-last_vblank;
-	  last_vblank = vbl.reply.sequence;
-	}
+  /* an unknown size is returned as -1, an element header that is broken
+     or cut by the end of the file makes us return zero */
 
-      vbl.request.sequence = vbl.reply.sequence+recording_interval;
+  if (n < 2 || pread (fd, b, n, pos) != n)
+    return 0;
 
+  for (idlen = 1; idlen <= 4 && !(b [0] & (0x100 >> idlen)); idlen++);
 
-      /*fprintf (stderr, "posting may_start semaphores\n");*/
+  if (idlen > 4 || idlen >= n)
+    return 0;
 
-      for (i = 0; i < nthreads; i++)
-	{
-	  sem_post (&may_start [i]);
-	}
+  for (szlen = 1; szlen <= 8 && !(b [idlen] & (0x100 >> szlen)); szlen++);
 
-      /*fprintf (stderr, "waiting has_finished semaphore\n");*/
+  if (szlen > 8 || idlen+szlen > n)
+    return 0;
 
-      for (i = 0; i < nthreads; i++)
-	{
-	  sem_wait (&has_finished);
-	}
+  *id = 0;
 
-      /*fprintf (stderr, "got has_finished semaphore\n");*/
+  for (i = 0; i < idlen; i++)
+    *id = (*id << 8) | b [i];
 
+  *size = b [idlen] & (0xff >> szlen);
 
-      /*convert_tiledx4kb_pixels_to_linear (out, buf, w, h, fb2->pitches [0], 0);*/
+  for (i = 1; i < szlen; i++)
+    *size = (*size << 8) | b [idlen+i];
+
+  if (*size == (1L << 7*szlen)-1)
+    *size = -1;
 
+  *header_len = idlen+szlen;
 
-      inframe.i_pts = num_frames_within_cluster;
+  return 1;
+}
 
-      outsz = x264_encoder_encode (enc, &nal, &i_nal, &inframe, &outframe);
 
-      if (outsz < 0)
-	{
-	  fprintf (stderr, "couldn't encode framebuffer content\n");
-	  exit (1);
-	}
-      else if (outsz)
+void
+recover_recording_and_exit (char *filename)
+{
+  struct cue_vector cue_vectors = {0}, *cuevec = &cue_vectors, *next;
+  int fd, cueind = 0, hl, chl, clusters = 0, complete, first_block, i;
+  unsigned char *cues, b [CUES_SEEK_SIZE];
+  unsigned long id, cid;
+  long size, csize, cluster_timestamp, key_timestamp = 0, key_pos,
+    cues_num = 0;
+  off_t file_size, pos, seg_body, seekh_pos = -1, end, cpos, limit, valid_end;
+  size_t cues_size;
+  struct stat st;
+
+
+  fd = open (filename, O_RDWR);
+
+  if (fd < 0 || fstat (fd, &st) < 0)
+    {
+      fprintf (stderr, "couldn't open %s: ", filename);
+      perror ("");
+      exit (1);
+    }
+
+  file_size = st.st_size;
+
+  if (!read_element_header (fd, 0, file_size, &id, &size, &hl)
+      || id != 0x1a45dfa3 || size < 0)
+    {
+      fprintf (stderr, "%s is not a matroska file\n", filename);
+      exit (1);
+    }
+
+  pos = hl+size;
+
+  if (!read_element_header (fd, pos, file_size, &id, &size, &hl)
+      || id != 0x18538067 || hl != 12)
+    {
+      fprintf (stderr, "%s was not recorded by screenrec\n", filename);
+      exit (1);
+    }
+
+  seg_body = pos+hl;
+  pos = valid_end = seg_body;
+
+  /* a single pass over the top level elements: clusters of known size are
+     skipped after their first block, the one that was being written when
+     the recording stopped is walked block by block and cut after the last
+     complete one */
+
+  while (read_element_header (fd, pos, file_size, &id, &size, &hl))
+    {
+      if (id == 0x1f43b675)
 	{
-	  if (outsz+4 > 268435455)
-	    fprintf (stderr, "skipping this frame because size (%d) is too "
-		     "big\n", outsz);
-	  else
+	  cpos = pos+hl;
+	  complete = size >= 0 && cpos+size <= file_size;
+	  limit = complete ? cpos+size : file_size;
+	  cluster_timestamp = 0;
+	  first_block = 1;
+	  key_pos = -1;
+
+	  while (read_element_header (fd, cpos, limit, &cid, &csize, &chl)
+		 && csize >= 0 && cpos+chl+csize <= limit)
 	    {
-	      timestamp_within_cluster = num_frames_within_cluster*frame_duration;
-
-	      if (0x7fff < timestamp_within_cluster
-		  || nal->i_type == NAL_SLICE_IDR)
+	      if (cid == 0xe7 && csize <= 8)
 		{
-		  /*if (nal->i_type != NAL_SLICE_IDR)
-		    fprintf (stderr, "warning: closing a cluster before a new IDR "
-		    "was reached\n");*/
-
-		  off = lseek (outfd, 0, SEEK_CUR);
-
-		  lseek (outfd, -cluster_size-4, SEEK_CUR);
-		  write_int32_bigend (outfd, 0x10000000 | cluster_size);
-
-		  lseek (outfd, off, SEEK_SET);
-		  timestamp_of_cluster += timestamp_within_cluster;
-		  cluster_offset_within_segment = lseek (outfd, 0, SEEK_CUR)
-		    -SEGMENT_BODY_START;
-		  write_cluster_header (outfd, timestamp_of_cluster);
-		  num_frames_within_cluster = 0;
-		  timestamp_within_cluster = 0;
-		  cluster_size = 10;
-		}
+		  memset (b, 0, 8);
 
-	      /*printf ("nal type is %d\n", nal->i_type);*/
+		  if (pread (fd, b+8-csize, csize, cpos+chl) != csize)
+		    break;
 
-	      if (nal->i_type == NAL_SLICE_IDR)
+		  for (i = 0; i < 8; i++)
+		    cluster_timestamp = (cluster_timestamp << 8) | b [i];
+		}
+	      else if (cid == 0xa3 && first_block && csize >= 4)
 		{
-		  /*fprintf (stderr, "keyframe at %d, offset is %d\n", timestamp_of_cluster
-		    +timestamp_within_cluster, cluster_offset_within_segment);*/
+		  if (pread (fd, b, 4, cpos+chl) != 4)
+		    break;
 
-		  if (cueind == CUE_VECTOR_SIZE)
+		  if (b [3] & 0x80)
 		    {
-		      cuevec->next = malloc_and_check (sizeof (*cuevec->next));
-		      cuevec = cuevec->next;
-		      cuevec->next = NULL;
-		      cueind = 0;
+		      key_timestamp = cluster_timestamp
+			+(short)(b [1] << 8 | b [2]);
+		      key_pos = cpos-pos-hl;
 		    }
 
-		  cuevec->cues [cueind].timestamp = timestamp_of_cluster
-		    +timestamp_within_cluster;
-		  cuevec->cues [cueind].cluster_position
-		    = cluster_offset_within_segment;
-		  cuevec->cues [cueind].relative_position = cluster_size;
-		  cueind++;
-		}
+		  first_block = 0;
 
-	      write_char (outfd, 0xa3);
-	      write_int32_bigend (outfd, 0x10000000 | (outsz+4));
+		  if (complete)  /* the rest needs no checking */
+		    {
+		      cpos = limit;
+		      break;
+		    }
+		}
+	      else if (cid != 0xa3 && cid != 0xec)
+		break;
 
-	      /*fprintf (stderr, "timestamp = %ld %ld\n", vbl.reply.tval_sec,
-		vbl.reply.tval_usec);*/
-	      /*fprintf (stderr, "timestamp = %d\n", timestamp_within_cluster);*/
+	      cpos += chl+csize;
+	    }
 
-	      write_char (outfd, 0x81);
-	      write_char (outfd, ((timestamp_within_cluster>>8) & 0xff));
-	      write_char (outfd, timestamp_within_cluster & 0xff);
-	      write_char (outfd, 0);
+	  /* a cluster cut by the end of the file can be kept only if its
+	     size can be patched in place, otherwise it is dropped */
 
-	      /*if (i_nal > 1)
-		{
-		  printf ("more than a nal produced\n");
+	  if ((cpos < limit || !complete) && (cpos == pos+hl || hl != 12))
+	    break;
 
-		  for (i = 0; i < i_nal; i++)
-		    printf ("nal type is %d\n", nal [i].i_type);
-		    }*/
+	  if (key_pos >= 0)
+	    {
+	      add_cue (&cuevec, &cueind, key_timestamp, pos-seg_body, key_pos);
+	      cues_num++;
+	    }
 
-	      if (write (outfd, nal->p_payload, outsz) != outsz)
-		{
-		  fprintf (stderr, "couldn't encode framebuffer content\n");
-		  exit (1);
-		}
+	  clusters++;
 
-	      cluster_size += outsz + 9;
+	  if (cpos < limit || !complete)
+	    {
+	      end = cpos-pos-hl;
+	      store_int64_bigend (b, EBML_SIZE8 (end));
+	      pwrite_fully (fd, b, 8, pos+4);
+	      valid_end = cpos;
+	      break;
 	    }
-	}
 
-      if (poll (&pfd, 1, 0) < 0)
-	{
-	  fprintf (stderr, "couldn't poll standard input\n");
-	  exit (1);
+	  pos = valid_end = limit;
+	  continue;
 	}
 
-      if (pfd.revents & POLLIN)
+      /* what follows the clusters are old cues or garbage */
+
+      if (clusters || size < 0 || pos+hl+size > file_size)
 	break;
-    }
 
-  fprintf (stderr, "finishing and adding cues...\n");
+      if (id == 0x114d9b74)
+	seekh_pos = pos;
+      else if (id == 0x1c53bb6b && hl+size >= 9)
+	{
+	  /* a cue checkpoint: the new cues at the end replace it */
 
+	  b [0] = 0xec;
+	  store_int64_bigend (b+1, EBML_SIZE8 (hl+size-9));
+	  pwrite_fully (fd, b, 9, pos);
+	}
 
-  off = lseek (outfd, 0, SEEK_CUR);
+      pos += hl+size;
+      valid_end = pos;
+    }
 
-  lseek (outfd, -cluster_size-4, SEEK_CUR);
-  write_int32_bigend (outfd, 0x10000000 | cluster_size);
+  if (!clusters)
+    {
+      fprintf (stderr, "no frames to recover in %s\n", filename);
+      exit (1);
+    }
 
-  lseek (outfd, seekh_off+46, SEEK_SET);
-  write_int32_bigend (outfd, off-SEGMENT_BODY_START);
+  if (ftruncate (fd, valid_end) < 0)
+    {
+      fprintf (stderr, "couldn't truncate %s: ", filename);
+      perror ("");
+      exit (1);
+    }
 
-  lseek (outfd, off, SEEK_SET);
-  write_int32_bigend (outfd, 0x1c53bb6b);
-  off = lseek (outfd, 0, SEEK_CUR);
-  write_int32_bigend (outfd, 0x00000000);
+  cues = make_cues (&cue_vectors, cueind, &cues_size);
+  pwrite_fully (fd, cues, cues_size, valid_end);
+  free (cues);
 
-  cuevec = &cue_vectors;
+  /* the seek of cues is still the void reserved for it, or points to a
+     checkpoint */
 
-  while (cuevec)
+  if (seekh_pos >= 0
+      && read_element_header (fd, seekh_pos, file_size, &id, &size, &hl))
     {
-      for (i = 0; i < (cuevec->next ? CUE_VECTOR_SIZE : cueind); i++)
+      end = seekh_pos+hl+size;
+      pos = seekh_pos+hl;
+
+      while (read_element_header (fd, pos, end, &cid, &csize, &chl)
+	     && csize >= 0)
 	{
-	  write_char (outfd, 0xbb); /* cue point */
-	  write_char (outfd, 0x9b);
+	  if (chl+csize == CUES_SEEK_SIZE
+	      && pread (fd, b, CUES_SEEK_SIZE, pos) == CUES_SEEK_SIZE
+	      && (b [0] == 0xec || !memcmp (b+6, "\x1c\x53\xbb\x6b", 4)))
+	    {
+	      fill_cues_seek (b, valid_end-seg_body);
+	      pwrite_fully (fd, b, CUES_SEEK_SIZE, pos);
+	      break;
+	    }
 
-	  write_char (outfd, 0xb3); /* cue time */
-	  write_char (outfd, 0x88);
-	  write_int64_bigend (outfd, cuevec->cues [i].timestamp);
+	  pos += chl+csize;
+	}
+    }
 
-	  write_char (outfd, 0xb7); /* cue track positions */
-	  write_char (outfd, 0x8f);
+  store_int64_bigend (b, EBML_SIZE8 (valid_end+cues_size-seg_body));
+  pwrite_fully (fd, b, 8, seg_body-8);
 
-	  write_char (outfd, 0xf7); /* cue track */
-	  write_char (outfd, 0x81);
-	  write_char (outfd, 0x01);
+  if (fsync (fd) < 0)
+    {
+      fprintf (stderr, "couldn't sync %s: ", filename);
+      perror ("");
+      exit (1);
+    }
 
-	  write_char (outfd, 0xf1); /* cue cluster position */
-	  write_char (outfd, 0x84);
-	  write_int32_bigend (outfd, cuevec->cues [i].cluster_position);
+  fprintf (stderr, "recovered %d clusters and rebuilt %ld cues, dropped %ld "
+	   "trailing bytes\n", clusters, cues_num,
+	   (long)(file_size-valid_end));
 
-	  write_char (outfd, 0xf0); /* cue relative position */
-	  write_char (outfd, 0x84);
-	  write_int32_bigend (outfd, cuevec->cues [i].relative_position);
-	}
+  cuevec = cue_vectors.next;
 
-      cuevec = cuevec->next;
+  while (cuevec)
+    {
+      next = cuevec->next;
+      free (cuevec);
+      cuevec = next;
     }
 
-  cues_size = lseek (outfd, 0, SEEK_CUR)-off-4;
-  lseek (outfd, off, SEEK_SET);
-  write_int32_bigend (outfd, 0x10000000 | cues_size);
-
-  off = lseek (outfd, 0, SEEK_END);
-  lseek (outfd, sizeof (ebml_header)+4, SEEK_SET);
-  write_int32_bigend (outfd, 0x10000000 | (off-SEGMENT_BODY_START));
-
+  close (fd);
   exit (0);
 }
 
@@ -1194,7 +6863,8 @@ print_help_and_exit (void)
 {
   printf ("options:\n"
 	  "\t--record-screen or -r:      record screen and print the binary data "
-	  "to stdout in MKV format\n"
+	  "to stdout in MKV format; when output is a pipe, a live stream is "
+	  "written without seeking\n"
 	  "\t--preset or -p PRESET:      select a preset when recording screen, "
 	  "default is medium\n"
 	  "\t--geometry or -g X,Y[,WxH]: select a portion of the screen to record "
@@ -1202,21 +6872,99 @@ print_help_and_exit (void)
 	  "for example 10,20,40x40\n"
 	  "\t--record-every-th or -y N   record one frame every N, defaults to one "
 	  "for recording at native refresh rate\n"
-	  "\t--output or -o FILE:        output file, required for recording\n"
+	  "\t--output or -o FILE:        output file for recording, default is "
+	  "stdout\n"
+	  "\t--format or -F FORMAT:      container of the recording, mkv (the "
+	  "default), mp4 for fragmented MP4, ts for MPEG-TS, h264 for a raw "
+	  "Annex B stream or raw for unencoded RGB frames; for screenshots, "
+	  "ppm (the default), png or qoi\n"
+	  "\t--udp or -U HOST:PORT:      send the recording live as MPEG-TS "
+	  "over UDP instead of writing a file\n"
+	  "\t--rtp:                      wrap the UDP datagrams in RTP\n"
+	  "\t--timestamp-scale or -t NS: length in nanoseconds of a timestamp "
+	  "tick in the recording, default is 1000000 (one millisecond)\n"
+	  "\t--cue-interval or -c SECS:  add a seek point at most every SECS "
+	  "seconds instead of at every keyframe\n"
+	  "\t--io-uring or -u:           write the recording asynchronously "
+	  "through io_uring, if available\n"
+	  "\t--prealloc or -a MB:        preallocate the output file in chunks "
+	  "of MB megabytes\n"
+	  "\t--direct-io:                write the output file with O_DIRECT, "
+	  "bypassing the page cache\n"
+	  "\t--segment-time or -T SECS:  split the recording in numbered files "
+	  "of about SECS seconds each\n"
+	  "\t--segment-size or -S MB:    split the recording in numbered files "
+	  "of about MB megabytes each\n"
+	  "\t--replay or -R SECS:        keep only the last SECS seconds in "
+	  "memory and save them to a numbered file on SIGUSR1\n"
+	  "\t--replay-size or -M MB:     keep at most MB megabytes for "
+	  "--replay, dropping the oldest seconds (default 1024)\n"
+	  "\t--checkpoint or -k SECS:    rewrite the seek points near the "
+	  "start of the file every SECS seconds, so that a crashed recording "
+	  "stays seekable\n"
+	  "\t--front-cues or -e SECS:    reserve room near the start of the "
+	  "file for the seek points of about SECS seconds of recording, so "
+	  "that players can seek without reading the end of the file\n"
+	  "\t--frame-ring or -m SLOTS:   also publish the last SLOTS raw "
+	  "frames in shared memory for local programs\n"
+	  "\t--publish-to or -P FILE:    publish those frames in FILE (for "
+	  "example under /dev/shm), which other users can open too\n"
+	  "\t--capture-to or -C FILE:    don't encode, only capture frames "
+	  "into a ring in FILE (for example under /dev/shm) for an encoder "
+	  "started with -E\n"
+	  "\t--encode-from or -E FILE:   encode the frames that a capture "
+	  "daemon puts in FILE, with the usual output options\n"
+	  "\t--send-to or -W LIST:       don't encode, send the frames to the "
+	  "encode workers in LIST, given as HOST:PORT[,HOST:PORT...]\n"
+	  "\t--gop or -G SECS:           length of the groups of pictures "
+	  "that each worker encodes in turn, default is 2\n"
+	  "\t--worker or -w PORT:        wait on PORT for frames from a "
+	  "capture client and encode them, one numbered output file per "
+	  "group of pictures\n"
+	  "\t--recover or -f FILE:       repair a recording that was "
+	  "interrupted, cutting the last incomplete cluster and rebuilding "
+	  "seek points\n"
 	  "\t--take-screenshot or -s:    take a screenshot and print "
 	  "the data to stdout in binary PPM format\n"
+	  "\t--burst or -b N:            take N screenshots into numbered "
+	  "files named after the -o option\n"
+	  "\t--interval or -i K[ms]:     take the screenshots of a burst every "
+	  "K vblanks (the default is one), or every K milliseconds\n"
+	  "\t--serve or -D SOCKET:       keep the framebuffer open and serve "
+	  "screenshots to the clients of the unix SOCKET, until ENTER, "
+	  "SIGTERM or SIGINT\n"
 	  "\t--dump-info or -d:          dump info about your DRM setup\n"
 	  "\t--help or -h:               print this help and exit\n");
   exit (0);
 }
 
 
+int
+parse_positive_int (char *arg, int opt)
+{
+  char *end;
+  long ret = strtol (arg, &end, 10);
+
+  if (!*arg || *end || ret <= 0 || ret > 0x7fffffff)
+    {
+      fprintf (stderr, "option '%c' requires a positive integer argument\n",
+	       opt);
+      print_help_and_exit ();
+    }
+
+  return ret;
+}
+
+
 int
 main (int argc, char *argv [])
 {
   enum action act = DUMP_INFO;
-  char *preset = "medium", *geometry = NULL, *output = NULL;
-  int i, need_arg = 0, record_interv = 1, x = -1, y = -1, w = -1, h = -1;
+  struct recording_options opts = {NULL, "medium", 1, 1000000};
+  char *geometry = NULL, *recover_file = NULL, *ring_file = NULL,
+    *worker_port = NULL, *socket_path = NULL, *end;
+  int i, need_arg = 0, x = -1, y = -1, w = -1, h = -1, format_given = 0;
+  long num;
 
 
   for (i = 1; i < argc; i++)
@@ -1226,7 +6974,7 @@ main (int argc, char *argv [])
 	  switch (need_arg)
 	    {
 	    case 'p':
-	      preset = argv [i];
+	      opts.preset = argv [i];
 	      break;
 	    case 'g':
 	      geometry = argv [i];
@@ -1238,10 +6986,126 @@ main (int argc, char *argv [])
 			   "between 1 and 9\n");
 		  print_help_and_exit ();
 		}
-	      record_interv = *argv [i]-'0';
+	      opts.recording_interval = *argv [i]-'0';
 	      break;
 	    case 'o':
-	      output = argv [i];
+	      opts.output = argv [i];
+	      break;
+	    case 't':
+	      opts.timestamp_scale = parse_positive_int (argv [i], 't');
+	      break;
+	    case 'c':
+	      opts.cue_interval = parse_positive_int (argv [i], 'c');
+	      break;
+	    case 'a':
+	      opts.prealloc_mb = parse_positive_int (argv [i], 'a');
+	      break;
+	    case 'T':
+	      opts.segment_time = parse_positive_int (argv [i], 'T');
+	      break;
+	    case 'S':
+	      opts.segment_size = parse_positive_int (argv [i], 'S');
+	      opts.segment_size <<= 20;
+	      break;
+	    case 'R':
+	      opts.replay_time = parse_positive_int (argv [i], 'R');
+	      break;
+	    case 'M':
+	      opts.replay_size = parse_positive_int (argv [i], 'M');
+	      opts.replay_size <<= 20;
+	      break;
+	    case 'F':
+	      if (!strcmp (argv [i], "mkv"))
+		opts.format = FORMAT_MATROSKA;
+	      else if (!strcmp (argv [i], "mp4"))
+		opts.format = FORMAT_MP4;
+	      else if (!strcmp (argv [i], "ts"))
+		opts.format = FORMAT_MPEGTS;
+	      else if (!strcmp (argv [i], "h264"))
+		opts.format = FORMAT_H264;
+	      else if (!strcmp (argv [i], "raw"))
+		opts.format = FORMAT_RAW;
+	      else if (!strcmp (argv [i], "ppm"))
+		opts.format = FORMAT_PPM;
+	      else if (!strcmp (argv [i], "png"))
+		opts.format = FORMAT_PNG;
+	      else if (!strcmp (argv [i], "qoi"))
+		opts.format = FORMAT_QOI;
+	      else
+		{
+		  fprintf (stderr, "option 'F' requires mkv, mp4, ts, h264, "
+			   "raw, ppm, png or qoi\n");
+		  print_help_and_exit ();
+		}
+
+	      format_given = 1;
+	      break;
+	    case 'U':
+	      opts.udp_dest = argv [i];
+	      opts.format = FORMAT_MPEGTS;
+	      break;
+	    case 'k':
+	      opts.checkpoint_interval = parse_positive_int (argv [i], 'k');
+	      break;
+	    case 'e':
+	      opts.front_cues_time = parse_positive_int (argv [i], 'e');
+	      break;
+	    case 'm':
+	      opts.ring_slots = parse_positive_int (argv [i], 'm');
+
+	      if (opts.ring_slots < 2)
+		{
+		  fprintf (stderr, "option 'm' requires at least 2 slots\n");
+		  print_help_and_exit ();
+		}
+	      break;
+	    case 'f':
+	      act = RECOVER;
+	      recover_file = argv [i];
+	      break;
+	    case 'C':
+	      act = RECORD;
+	      opts.capture_to = argv [i];
+	      break;
+	    case 'P':
+	      opts.publish_to = argv [i];
+	      break;
+	    case 'E':
+	      act = ENCODE;
+	      ring_file = argv [i];
+	      break;
+	    case 'W':
+	      act = RECORD;
+	      opts.send_to = argv [i];
+	      break;
+	    case 'G':
+	      opts.gop_time = parse_positive_int (argv [i], 'G');
+	      break;
+	    case 'D':
+	      act = SERVE;
+	      socket_path = argv [i];
+	      break;
+	    case 'b':
+	      act = SCREENSHOT;
+	      opts.burst = parse_positive_int (argv [i], 'b');
+	      break;
+	    case 'i':
+	      num = strtol (argv [i], &end, 10);
+	      opts.burst_interval_ms = !strcmp (end, "ms");
+
+	      if (end == argv [i] || (*end && !opts.burst_interval_ms)
+		  || num <= 0 || num > 0x7fffffff)
+		{
+		  fprintf (stderr, "option 'i' requires a positive number of "
+			   "vblanks, or of milliseconds followed by ms\n");
+		  print_help_and_exit ();
+		}
+
+	      opts.burst_interval = num;
+	      break;
+	    case 'w':
+	      act = WORKER;
+	      worker_port = argv [i];
 	      break;
 	    }
 
@@ -1258,6 +7122,61 @@ main (int argc, char *argv [])
 	need_arg = 'y';
       else if (!strcmp (argv [i], "--output") || !strcmp (argv [i], "-o"))
 	need_arg = 'o';
+      else if (!strcmp (argv [i], "--format") || !strcmp (argv [i], "-F"))
+	need_arg = 'F';
+      else if (!strcmp (argv [i], "--udp") || !strcmp (argv [i], "-U"))
+	need_arg = 'U';
+      else if (!strcmp (argv [i], "--rtp"))
+	opts.rtp = 1;
+      else if (!strcmp (argv [i], "--timestamp-scale")
+	       || !strcmp (argv [i], "-t"))
+	need_arg = 't';
+      else if (!strcmp (argv [i], "--cue-interval")
+	       || !strcmp (argv [i], "-c"))
+	need_arg = 'c';
+      else if (!strcmp (argv [i], "--io-uring") || !strcmp (argv [i], "-u"))
+	opts.use_uring = 1;
+      else if (!strcmp (argv [i], "--prealloc") || !strcmp (argv [i], "-a"))
+	need_arg = 'a';
+      else if (!strcmp (argv [i], "--direct-io"))
+	opts.direct_io = 1;
+      else if (!strcmp (argv [i], "--segment-time")
+	       || !strcmp (argv [i], "-T"))
+	need_arg = 'T';
+      else if (!strcmp (argv [i], "--segment-size")
+	       || !strcmp (argv [i], "-S"))
+	need_arg = 'S';
+      else if (!strcmp (argv [i], "--replay") || !strcmp (argv [i], "-R"))
+	need_arg = 'R';
+      else if (!strcmp (argv [i], "--replay-size") || !strcmp (argv [i], "-M"))
+	need_arg = 'M';
+      else if (!strcmp (argv [i], "--checkpoint") || !strcmp (argv [i], "-k"))
+	need_arg = 'k';
+      else if (!strcmp (argv [i], "--front-cues") || !strcmp (argv [i], "-e"))
+	need_arg = 'e';
+      else if (!strcmp (argv [i], "--frame-ring") || !strcmp (argv [i], "-m"))
+	need_arg = 'm';
+      else if (!strcmp (argv [i], "--capture-to") || !strcmp (argv [i], "-C"))
+	need_arg = 'C';
+      else if (!strcmp (argv [i], "--publish-to") || !strcmp (argv [i], "-P"))
+	need_arg = 'P';
+      else if (!strcmp (argv [i], "--encode-from")
+	       || !strcmp (argv [i], "-E"))
+	need_arg = 'E';
+      else if (!strcmp (argv [i], "--send-to") || !strcmp (argv [i], "-W"))
+	need_arg = 'W';
+      else if (!strcmp (argv [i], "--gop") || !strcmp (argv [i], "-G"))
+	need_arg = 'G';
+      else if (!strcmp (argv [i], "--worker") || !strcmp (argv [i], "-w"))
+	need_arg = 'w';
+      else if (!strcmp (argv [i], "--burst") || !strcmp (argv [i], "-b"))
+	need_arg = 'b';
+      else if (!strcmp (argv [i], "--serve") || !strcmp (argv [i], "-D"))
+	need_arg = 'D';
+      else if (!strcmp (argv [i], "--interval") || !strcmp (argv [i], "-i"))
+	need_arg = 'i';
+      else if (!strcmp (argv [i], "--recover") || !strcmp (argv [i], "-f"))
+	need_arg = 'f';
       else if (!strcmp (argv [i], "--take-screenshot")
 	  || !strcmp (argv [i], "-s"))
 	act = SCREENSHOT;
@@ -1345,19 +7264,84 @@ main (int argc, char *argv [])
   if (act == DUMP_INFO)
     dump_drm_info_and_exit ();
 
+  if (act == RECOVER)
+    recover_recording_and_exit (recover_file);
+
+  if (act == SERVE)
+    serve_screenshots_and_exit (socket_path);
+
+  /* screenshots have image formats of their own, and the default
+     container of a recording means ppm for them */
+
+  if (act == SCREENSHOT && !format_given)
+    opts.format = FORMAT_PPM;
+
+  if (act == SCREENSHOT && opts.format != FORMAT_PPM
+      && opts.format != FORMAT_PNG && opts.format != FORMAT_QOI)
+    {
+      fprintf (stderr, "screenshots are written as ppm, png or qoi\n");
+      exit (1);
+    }
+
+  if (act == SCREENSHOT && opts.burst)
+    {
+      if (!opts.burst_interval)
+	opts.burst_interval = 1;
+
+      take_burst_and_exit (&opts, x, y, w, h);
+    }
+
   if (act == SCREENSHOT)
-    take_screenshot_and_exit (x, y, w, h);
+    take_screenshot_and_exit (x, y, w, h, opts.format);
+
+  if (opts.format == FORMAT_PPM || opts.format == FORMAT_PNG
+      || opts.format == FORMAT_QOI)
+    {
+      fprintf (stderr, "ppm, png and qoi are only for screenshots\n");
+      exit (1);
+    }
+
+  if (act == ENCODE)
+    encode_from_ring_and_exit (&opts, ring_file);
+
+  if (act == WORKER)
+    run_encode_worker_and_exit (&opts, worker_port);
 
   if (act == RECORD)
     {
-      if (!output)
+      /* a few slots absorb the hiccups of the encoder */
+
+      if ((opts.capture_to || opts.publish_to) && !opts.ring_slots)
+	opts.ring_slots = 8;
+
+      if (opts.capture_to && opts.publish_to)
 	{
-	  fprintf (stderr, "for recording, you must provide an output file with "
-		   "-o or --output\n");
-	  print_help_and_exit ();
+	  fprintf (stderr, "a capture daemon's ring is already published in "
+		   "its file\n");
+	  exit (1);
+	}
+
+      if (opts.send_to && !opts.send_to [strspn (opts.send_to, ",")])
+	{
+	  fprintf (stderr, "option 'W' needs at least one address\n");
+	  exit (1);
+	}
+
+      if (opts.send_to && opts.ring_slots)
+	{
+	  fprintf (stderr, "frames sent to encode workers can't go to a "
+		   "frame ring too\n");
+	  exit (1);
+	}
+
+      if (opts.format == FORMAT_RAW && (opts.send_to || opts.ring_slots))
+	{
+	  fprintf (stderr, "raw frames can't go to a frame ring or to encode "
+		   "workers too\n");
+	  exit (1);
 	}
 
-      record_screen_and_exit (output, preset, x, y, w, h, record_interv);
+      record_screen_and_exit (&opts, x, y, w, h);
     }
 
   return 0;